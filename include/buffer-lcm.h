@@ -1,20 +1,32 @@
 #include <stddef.h>
-#include <unordered_set>
+#include <vector>
+#include <sys/uio.h>
 
+/**
+ * Pool of `num_bufs` equally sized buffers carved out of a single
+ * page-aligned allocation. Buffers are handed out by index so that the
+ * same index can be used with io_uring's registered (fixed) buffers.
+ */
 class BufferManager
 {
 public:
     BufferManager(int num_bufs, size_t size);
     BufferManager();
+    ~BufferManager();
     void init(int num_bufs, size_t size);
-    char* get_next_buf();
-    void free_buf(char* buf);
+    int get_next_buf();
+    char* get_buf(int idx);
+    void free_buf(int idx);
     void free_all();
+    size_t num_free();
+    const std::vector<struct iovec>& get_iovecs();
 private:
-    int i_;
     int num_bufs_;
-    std::unordered_set<char *> bufs_;
+    char* pool_;
+    std::vector<int> free_bufs_;
+    std::vector<struct iovec> iovecs_;
     size_t size_;
+    size_t stride_;
     size_t page_size_;
 };
 
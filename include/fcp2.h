@@ -7,25 +7,40 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
+#include <deque>
 #include <memory>
+#include <cassert>
+#include <cstring>
+#include <fcntl.h>
 #include <liburing.h>
 
+#include "getdents.h"
+
 
 #define RINGSIZE 32768
 #define REG_FD_SIZE 32768
-#define IORING_OP_GETDENTS64 41
 #define MAX_RW_BUF_SIZE 131072
+// # of directories read at once; bounds dirent buffer memory
+#define DIRENT_BUF_POOL_SIZE 64
+// # of O_PATH directory fds kept open to open/stat their children by name
+#define MAX_DIR_FDS 512
+// CQ entries (IORING_SETUP_CQSIZE); more than the SQ, as requests stay in
+// flight long after their sqes have been consumed. The kernel allows at
+// most twice its maximum SQ size (IORING_MAX_CQ_ENTRIES).
+#define CQ_SIZE (2 * RINGSIZE)
+// SQ/CQ entries kept for the requests completions issue without credits:
+// further getdents, mkdirs of new directories and closes
+#define RING_RESERVE 4096
+// Credits::admit must be able to pass the largest request, a first chunk
+// with its opens and closes (6 sqes, 4 cqes), on an idle ring
+static_assert(RING_RESERVE + 6 <= RINGSIZE && RING_RESERVE + 4 <= CQ_SIZE,
+              "RING_RESERVE leaves no room for credited requests");
+// Bytes of copy buffers in flight
+#define MAX_INFLIGHT_BUF_BYTES (256UL * 1024 * 1024)
+// Most files of one directory handed to an idle worker at once
+#define SHARE_FILES 256
 
 
-struct linux_dirent64 {
-	int64_t		d_ino;    /* 64-bit inode number */
-	int64_t		d_off;    /* 64-bit offset to next structure */
-	unsigned short	d_reclen; /* Size of this dirent */
-	unsigned char	d_type;   /* File type */
-	char		d_name[]; /* Filename (null-terminated) */
-};
-
-#define DIR_BUF_SIZE 65535
 // #define MAX_DIR_ENT DIR_BUF_SIZE / sizeof(linux_dirent64)
 
 enum {
@@ -40,6 +55,10 @@ enum {
     FCP_OP_STAT_COPY_JOB,
     FCP_OP_CLOSEDIR,
     FCP_OP_CLOSEFILE,
+    FCP_OP_OPENSRCDIR,
+    FCP_OP_OPENDSTDIR,
+    // --phys_order: plain open of a source, for FIEMAP
+    FCP_OP_OPENPHYS,
 };
 
 // States for copy job
@@ -57,34 +76,175 @@ enum {
 
 class CopyJob;
 
+// user_data of an sqe: (op type << 32) | meta index. Ops whose success cqe is
+// skipped carry NO_META, and only their type is known on failure.
+#define NO_META 0xffffffffu
+
+static inline uint64_t make_user_data(int type, uint32_t idx) {
+    return ((uint64_t)type << 32) | idx;
+}
+
+static inline int user_data_type(uint64_t user_data) {
+    return (int)(user_data >> 32);
+}
+
+static inline uint32_t user_data_idx(uint64_t user_data) {
+    return (uint32_t)user_data;
+}
+
+// File names, interned once and referred to by id. Names are appended to
+// fixed-size blocks that are never moved, so their pointers can be handed
+// to the kernel.
+class NameArena {
+private:
+    static constexpr uint32_t NAME_BLOCK_SHIFT = 20;
+    static constexpr uint32_t NAME_BLOCK_SIZE = 1 << NAME_BLOCK_SHIFT;
+    std::vector<std::unique_ptr<char[]>> blocks;
+    uint32_t used;
+public:
+    NameArena() {
+        used = NAME_BLOCK_SIZE;
+    }
+
+    uint32_t add(const char *name) {
+        size_t len = strlen(name) + 1;
+        assert(len <= NAME_BLOCK_SIZE);
+        if(used + len > NAME_BLOCK_SIZE) {
+            blocks.emplace_back(new char[NAME_BLOCK_SIZE]);
+            used = 0;
+        }
+        uint32_t id = ((blocks.size() - 1) << NAME_BLOCK_SHIFT) | used;
+        memcpy(&blocks.back()[used], name, len);
+        used += len;
+        return id;
+    }
+
+    const char* get(uint32_t id) {
+        return &blocks[id >> NAME_BLOCK_SHIFT][id & (NAME_BLOCK_SIZE - 1)];
+    }
+};
+
 class RequestMeta {
 public:
-    // TODO: Define getter/setter
-    std::filesystem::path dirpath;
-    // to be used by readdir TODO: need better abstractions
-    std::filesystem::path dest_dirpath;
+    // Full path, only built when an op can't go relative to a directory fd
+    std::string path;
     int type;
     int reg_fd;
     std::shared_ptr<CopyJob> cp_job;
-    std::unique_ptr<struct statx> statbuf;
+    // statx: filled in by the kernel. Part of the slot, which the slab never
+    // moves or frees, so stats don't allocate.
+    struct statx statbuf;
     int copy_req_bytes;
+    // mkdir: the directory created, getdents: the destination directory
+    int dir_node;
+    // getdents: index of the dirent buffer and where the next read starts
+    int dirent_buf;
+    uint64_t dir_off;
+    // write: the buffer of the chunk, freed with its cqe
+    char *buf;
+    // Slot in the MetaSlab, and the next free slot while this one is free
+    uint32_t idx;
+    uint32_t next_free;
 
     RequestMeta(int type) {
         this->type = type;
         this->reg_fd = -1;
         cp_job = NULL;
-        statbuf = NULL;
         copy_req_bytes = 0;
+        dir_node = -1;
+        dirent_buf = -1;
+        dir_off = 0;
+        buf = NULL;
+        idx = NO_META;
+        next_free = NO_META;
+    }
+};
+
+// RequestMetas live in a deque so they never move, and are recycled through
+// an intrusive free list when their cqe has been processed.
+class MetaSlab {
+private:
+    std::deque<RequestMeta> slots;
+    uint32_t free_head;
+public:
+    MetaSlab() {
+        free_head = NO_META;
+    }
+
+    RequestMeta* alloc(int type) {
+        RequestMeta *meta;
+        if(free_head != NO_META) {
+            meta = &slots[free_head];
+            free_head = meta->next_free;
+            meta->type = type;
+            meta->next_free = NO_META;
+        } else {
+            assert(slots.size() < NO_META);
+            meta = &slots.emplace_back(type);
+            meta->idx = slots.size() - 1;
+        }
+        return meta;
+    }
+
+    RequestMeta* get(uint32_t idx) {
+        return &slots[idx];
+    }
+
+    void release(RequestMeta *meta) {
+        // Drop the references, but keep the capacity of the paths
+        meta->path.clear();
+        meta->reg_fd = -1;
+        meta->cp_job.reset();
+        meta->copy_req_bytes = 0;
+        meta->dir_node = -1;
+        meta->dirent_buf = -1;
+        meta->dir_off = 0;
+        meta->buf = NULL;
+        meta->next_free = free_head;
+        free_head = meta->idx;
     }
 };
 
 
+// A destination directory. Whatever needs it to exist waits on its node, and
+// is released by its mkdir cqe.
+class DirNode {
+public:
+    // Last component, shared by source and destination; for the directory
+    // being copied (parent 0) the full paths of both
+    uint32_t src_name;
+    uint32_t dst_name;
+    bool created;
+    // subdirectories whose mkdir waits for this one
+    std::vector<int> waiting_mkdirs;
+    // copy jobs waiting to open their destination file
+    std::vector<std::shared_ptr<CopyJob>> waiting_jobs;
+    // O_PATH fds of the source and destination directories, -1 until (or
+    // unless) opened. Children are opened/stat'ed relative to them.
+    // io_uring can't take a fixed file as the dirfd of openat/statx/mkdirat,
+    // so these are regular fds.
+    int src_fd;
+    int dst_fd;
+    int parent;
+    // The listing, the copy jobs and subdirectories in it; fds are closed
+    // when it drops to 0
+    int refs;
+
+    DirNode(uint32_t src_name, uint32_t dst_name, bool created, int parent) {
+        this->src_name = src_name;
+        this->dst_name = dst_name;
+        this->created = created;
+        this->src_fd = -1;
+        this->dst_fd = -1;
+        this->parent = parent;
+        this->refs = 1;
+    }
+};
+
 class CopyJob {
 private:
-    std::filesystem::path src;
-    std::filesystem::path dst;
-    std::string src_path;
-    std::string dst_path;
+    // NameArena id of the file name, in the directory of dst_dir_node
+    uint32_t name;
     ssize_t size;
     ssize_t n_bytes_copy_submitted;
     ssize_t n_bytes_copy_completed;
@@ -92,37 +252,30 @@ private:
     // file index
     int src_fd;
     int dst_fd;
+    // DirNode of the destination directory
+    int dst_dir_node;
     bool src_opened;
     bool dst_opened;
-    char *buf;
+    bool open_submitted;
+    bool close_submitted;
+    // A chunk failed: no more are submitted
+    bool failed;
+    // --phys_order: byte offset on the source device where the data starts
+    uint64_t phys;
 public:
-    CopyJob(const std::filesystem::path& src, const std::filesystem::path& dst) {
-        //! FIXME: Too much string copying, fix me
-        this->src = src;
-        this->dst = dst;
-        this->src_path = this->src.string();
-        this->dst_path = this->dst.string();
+    CopyJob(uint32_t name, int dst_dir_node) {
+        this->name = name;
+        this->dst_dir_node = dst_dir_node;
         this->n_bytes_copy_submitted = 0;
         this->n_bytes_copy_completed = 0;
         this->size = -1;
         this->state = COPY_STAT_PENDING;
         this->src_opened = false;
         this->dst_opened = false;
-    }
-
-    char* get_buf() {
-        return this->buf;
-    }
-
-    void set_buf(char *buf) {
-        this->buf = buf;
-    }
-
-    void free_buf() {
-        if(this->buf == NULL)
-            return;
-        free(this->buf);
-        this->buf = NULL;
+        this->open_submitted = false;
+        this->close_submitted = false;
+        this->failed = false;
+        this->phys = 0;
     }
 
     bool is_dst_opened() {
@@ -133,6 +286,10 @@ public:
         return this->src_opened;
     }
 
+    bool is_open_submitted() {
+        return this->open_submitted;
+    }
+
     void set_src_opened() {
         this->src_opened = true;
     }
@@ -141,6 +298,30 @@ public:
         this->dst_opened = true;
     }
 
+    void set_open_submitted() {
+        this->open_submitted = true;
+    }
+
+    bool is_close_submitted() {
+        return this->close_submitted;
+    }
+
+    void set_close_submitted() {
+        this->close_submitted = true;
+    }
+
+    void clear_close_submitted() {
+        this->close_submitted = false;
+    }
+
+    bool is_failed() {
+        return this->failed;
+    }
+
+    void set_failed() {
+        this->failed = true;
+    }
+
     void set_src_fd(int fd) {
         this->src_fd = fd;
     }
@@ -165,16 +346,12 @@ public:
         this->state = state;
     }
 
-    std::string& get_src_path() {
-        return this->src_path;
+    uint32_t get_name() {
+        return this->name;
     }
 
-    std::string& get_dst_path() {
-        return this->dst_path;
-    }
-
-    std::string get_dst_dir() {
-        return this->dst.parent_path().string();
+    int get_dst_dir_node() {
+        return this->dst_dir_node;
     }
 
     ssize_t get_size() {
@@ -185,6 +362,14 @@ public:
         this->size = size;
     }
 
+    uint64_t get_phys() {
+        return this->phys;
+    }
+
+    void set_phys(uint64_t phys) {
+        this->phys = phys;
+    }
+
     ssize_t get_bytes_copy_submitted() {
         return this->n_bytes_copy_submitted;
     }
@@ -202,16 +387,97 @@ public:
     }
 };
 
-// TODO: There's probably a better allocator for this
+// Returned by RegFDAllocator::get_free() when the kernel picks the slot
+#define FD_KERNEL_ALLOC -2
+
+// Admission control. New directory reads, stats and copy chunks are only
+// started when the SQ, the CQ and the buffer budget can take them; fixed
+// file slots are checked with their allocator. Requests issued from
+// completions don't wait for credits and use the RING_RESERVE entries.
+class Credits {
+private:
+    struct io_uring *ring;
+    unsigned cq_size;
+    // cqes still to be posted for what was submitted
+    unsigned cqes_in_flight;
+    size_t buf_bytes;
+public:
+    Credits() {
+        ring = NULL;
+        cq_size = 0;
+        cqes_in_flight = 0;
+        buf_bytes = 0;
+    }
+
+    void init(struct io_uring *ring, unsigned cq_size) {
+        this->ring = ring;
+        this->cq_size = cq_size;
+    }
+
+    // Whether `sqes` more requests, posting up to `cqes` cqes and using
+    // `bytes` of buffers, fit
+    bool admit(unsigned sqes, unsigned cqes, size_t bytes) {
+        if(io_uring_sq_space_left(ring) < sqes + RING_RESERVE)
+            return false;
+        if(cqes_in_flight + cqes + RING_RESERVE > cq_size)
+            return false;
+        return buf_bytes + bytes <= MAX_INFLIGHT_BUF_BYTES;
+    }
+
+    void take_cqes(unsigned n) {
+        cqes_in_flight += n;
+    }
+
+    void put_cqes(unsigned n) {
+        assert(cqes_in_flight >= n);
+        cqes_in_flight -= n;
+    }
+
+    unsigned get_cqes_in_flight() {
+        return cqes_in_flight;
+    }
+
+    void take_buf(size_t bytes) {
+        buf_bytes += bytes;
+    }
+
+    void put_buf(size_t bytes) {
+        assert(buf_bytes >= bytes);
+        buf_bytes -= bytes;
+    }
+};
+
+// Fixed file slots. Free slots are kept in a bitmap, with a second level
+// marking the words that still have a free bit, so a slot is found with two
+// find-first-set's. In kernel_alloc mode the kernel picks the slot
+// (IORING_FILE_INDEX_ALLOC) and only the number of free slots is tracked.
 template <int N>
 class RegFDAllocator {
 private:
-    std::vector<bool> busy_list;
+    static constexpr int WORDS = (N + 63) / 64;
+    static constexpr int SUMMARY_WORDS = (WORDS + 63) / 64;
+    // bit set = slot free
+    uint64_t free_bits[WORDS];
+    // bit set = free_bits word has a free slot
+    uint64_t free_words[SUMMARY_WORDS];
+    int n_free;
+    bool kernel_alloc;
+
+    void set_free(int idx) {
+        free_bits[idx / 64] |= 1ULL << (idx % 64);
+        free_words[idx / 4096] |= 1ULL << ((idx / 64) % 64);
+    }
 public:
     std::vector<int> fd_list;
-    // TODO: Write destructor.
+
     RegFDAllocator() {
-        busy_list.resize(N, false);
+        memset(free_bits, 0, sizeof(free_bits));
+        memset(free_words, 0, sizeof(free_words));
+        // Slots 0-4 are never handed out
+        for(int i=5; i<N; i++)
+            set_free(i);
+        n_free = N - 5;
+        kernel_alloc = false;
         fd_list.resize(N, -1);
     }
 
@@ -219,25 +485,95 @@ public:
         return N;
     }
 
-    // Returns -1 if full
+    void set_kernel_alloc(bool enable) {
+        kernel_alloc = enable;
+    }
+
+    bool is_kernel_alloc() {
+        return kernel_alloc;
+    }
+
+    int num_free() {
+        return n_free;
+    }
+
+    // Returns -1 if full, FD_KERNEL_ALLOC in kernel_alloc mode
     int get_free() {
-        for(int i=5; i<N; i++) {
-            if(!busy_list[i]) {
-                busy_list[i] = true;
-                return i;
-            }
+        if(n_free == 0)
+            return -1;
+        n_free--;
+        if(kernel_alloc)
+            return FD_KERNEL_ALLOC;
+
+        for(int i=0; i<SUMMARY_WORDS; i++) {
+            if(free_words[i] == 0)
+                continue;
+            int word = i * 64 + __builtin_ctzll(free_words[i]);
+            int bit = __builtin_ctzll(free_bits[word]);
+            free_bits[word] &= free_bits[word] - 1;
+            if(free_bits[word] == 0)
+                free_words[i] &= ~(1ULL << (word % 64));
+            return word * 64 + bit;
         }
-        std::cerr << "Failed to get a free filedescriptor, crashing " << std::endl;
-        exit(1);
+        assert(0);
         return -1;
     }
 
     int release(int idx) {
-        assert(busy_list[idx]);
-        busy_list[idx] = false;
+        assert(idx >= 0 && idx < N);
+        if(!kernel_alloc) {
+            assert(!(free_bits[idx / 64] & (1ULL << (idx % 64))));
+            set_free(idx);
+        }
+        n_free++;
 
         return 0;
     }
 };
 
-#endif
\ No newline at end of file
+// Buffers for getdents, handed out by index and reused across directories
+template <int N>
+class DirentBufPool {
+private:
+    std::vector<std::vector<uint8_t>> bufs;
+    std::vector<int> free_list;
+public:
+    DirentBufPool() {
+        bufs.resize(N);
+        for(int i=N-1; i>=0; i--)
+            free_list.push_back(i);
+    }
+
+    // Returns -1 if all buffers are in use
+    int get_free() {
+        if(free_list.empty())
+            return -1;
+        int idx = free_list.back();
+        free_list.pop_back();
+        // Allocated on first use, kept until exit
+        if(bufs[idx].empty())
+            bufs[idx].resize(DIR_BUF_SIZE);
+        return idx;
+    }
+
+    uint8_t* get_buf(int idx) {
+        return bufs[idx].data();
+    }
+
+    void release(int idx) {
+        free_list.push_back(idx);
+    }
+};
+
+// A directory handed from one worker to another. Its destination exists;
+// the worker that takes it copies `files` into it and, with `list`, reads
+// the directory for the rest. Paths are full, as the two workers don't
+// share DirNodes.
+struct SharedDir {
+    std::string src_path;
+    std::string dst_path;
+    bool list;
+    std::vector<std::string> files;
+};
+
+#endif
@@ -0,0 +1,12 @@
+#include <stdint.h>
+
+/**
+ * Physical placement of files, to copy them in the order they sit on
+ * disk (--phys_order): on rotational media, reading files one after the
+ * other by location turns directory-order seeks into mostly sequential
+ * reads.
+ */
+
+//! byte offset on its device of the first extent of the file open on `fd`,
+//! 0 if it has none (e.g. empty or inline) or the filesystem can't tell
+uint64_t first_phys_offset(int fd);
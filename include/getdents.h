@@ -0,0 +1,47 @@
+#ifndef _GETDENTS_H_
+#define _GETDENTS_H_
+
+#include <stdint.h>
+#include <liburing.h>
+
+//! Needs a kernel with the (unreleased) io_uring getdents64 patches applied
+#define IORING_OP_GETDENTS64 41
+
+struct linux_dirent64 {
+	int64_t		d_ino;    /* 64-bit inode number */
+	int64_t		d_off;    /* 64-bit offset to next structure */
+	unsigned short	d_reclen; /* Size of this dirent */
+	unsigned char	d_type;   /* File type */
+	char		d_name[]; /* Filename (null-terminated) */
+};
+
+#define DIR_BUF_SIZE 65535
+
+/**
+ * Whether the kernel of `ring` has the getdents64 patches. They add it as
+ * the newest opcode, while stock kernels since 5.19 use 41 for
+ * IORING_OP_FSETXATTR, so the opcode being supported isn't enough
+ */
+static inline bool io_uring_getdents64_supported(struct io_uring *ring)
+{
+	struct io_uring_probe *probe = io_uring_get_probe_ring(ring);
+	if (!probe)
+		return false;
+	bool ok = probe->last_op == IORING_OP_GETDENTS64 &&
+		  io_uring_opcode_supported(probe, IORING_OP_GETDENTS64);
+	io_uring_free_probe(probe);
+	return ok;
+}
+
+/**
+ * `offset` is the directory position to read from: 0, or the d_off of the
+ * last entry returned by the previous read on `fd`
+ */
+static inline void io_uring_prep_getdents64(struct io_uring_sqe *sqe, int fd,
+					    void *buf, unsigned int count,
+					    uint64_t offset)
+{
+	io_uring_prep_rw(IORING_OP_GETDENTS64, sqe, fd, buf, count, offset);
+}
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef _WAIT_POLICY_H_
+#define _WAIT_POLICY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <liburing.h>
+
+//! µs to poll the CQ before sleeping for a cqe
+#define DEFAULT_SPIN_US 50
+//! # of cqes reaped with a single CQ head update
+#define REAP_BATCH 256
+
+/**
+ * Spin-then-block wait for io_uring completions: the CQ is polled for up
+ * to `spin_us` microseconds, after which the thread sleeps in the kernel
+ * until a cqe is posted. Time spent in each is accumulated for report().
+ */
+class WaitPolicy
+{
+public:
+    //! Never sleep; the CQ is polled until a cqe shows up
+    static const unsigned SPIN_FOREVER = ~0U;
+
+    WaitPolicy();
+    void init(unsigned spin_us);
+    //! Same contract as io_uring_wait_cqe
+    int wait_cqe(struct io_uring* ring, struct io_uring_cqe** cqe_ptr);
+    void report(FILE* out) const;
+private:
+    unsigned spin_us_;
+    uint64_t spin_ns_;
+    uint64_t sleep_ns_;
+    //! # of waits that were satisfied while spinning, and that slept
+    uint64_t n_spun_;
+    uint64_t n_slept_;
+};
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef _WORK_POOL_H_
+#define _WORK_POOL_H_
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+
+//! µs an idle thread sleeps before looking for work again
+#define IDLE_WAIT_US 100
+
+/**
+ * Work shared by the threads of `-j`. Each thread pushes to and pops from
+ * the back of its own deque, and steals from the front of the others' when
+ * it runs dry: the oldest items, i.e. the biggest subtrees.
+ * An item is outstanding from its push until done(), which comes after the
+ * work it found has been pushed, so 0 outstanding means all is copied.
+ */
+template <typename T>
+class work_pool
+{
+public:
+    //! `n_started` items are held by threads from the start, without a push
+    explicit work_pool(int n_threads, long n_started = 0)
+        : shards_(n_threads), outstanding_(n_started) {}
+
+    void push(int self, T&& w)
+    {
+        outstanding_++;
+        std::lock_guard<std::mutex> guard(shards_[self].lock);
+        shards_[self].q.push_back(std::move(w));
+    }
+
+    bool pop(int self, T& w)
+    {
+        const int n = shards_.size();
+        for (int i = 0; i < n; i++)
+        {
+            auto& shard = shards_[(self + i) % n];
+            std::lock_guard<std::mutex> guard(shard.lock);
+            if (shard.q.empty()) continue;
+            if (i == 0)
+            {
+                w = std::move(shard.q.back());
+                shard.q.pop_back();
+            }
+            else
+            {
+                w = std::move(shard.q.front());
+                shard.q.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void done(long n = 1)
+    {
+        outstanding_ -= n;
+    }
+
+    bool finished() const
+    {
+        return outstanding_ == 0 || aborted_;
+    }
+
+    //! a thread gave up, don't wait for its items
+    void abort()
+    {
+        aborted_ = true;
+    }
+
+    bool has_idle() const
+    {
+        return n_idle_ > 0;
+    }
+
+    //! nothing to pop, give the other threads time to push
+    void idle()
+    {
+        n_idle_++;
+        usleep(IDLE_WAIT_US);
+        n_idle_--;
+    }
+
+private:
+    struct shard
+    {
+        std::mutex lock;
+        std::deque<T> q;
+    };
+    std::vector<shard> shards_;
+    std::atomic<long> outstanding_;
+    std::atomic<bool> aborted_{false};
+    std::atomic<int> n_idle_{0};
+};
+
+#endif
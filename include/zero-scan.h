@@ -0,0 +1,16 @@
+#include <stddef.h>
+
+/**
+ * Finding the blocks of zeros in data that was read, so that they can be
+ * left as holes instead of written (--sparse=always). The widest vector
+ * extension the CPU has (AVX2, SSE2, or none) is picked at the first call.
+ * Scans stop at the first non-zero byte, so blocks of data cost little.
+ */
+
+//! true if the `len` bytes at `buf` are all zero
+bool is_zero(const char* buf, size_t len);
+
+//! # of bytes at the start of `buf` that are whole `blk` sized blocks
+//! all of zeros (`zero`), or all with some data (`!zero`); a short last
+//! block counts as a block
+size_t block_run(const char* buf, size_t len, size_t blk, bool zero);
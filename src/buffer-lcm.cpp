@@ -41,50 +41,84 @@ buffer_lcm (const size_t a, const size_t b, const size_t lcm_max)
 }
 
 
-BufferManager::BufferManager(int num_bufs, size_t size): num_bufs_(num_bufs), size_(size), i_(0)
+BufferManager::BufferManager(int num_bufs, size_t size): pool_(NULL)
 {
   page_size_ = getpagesize();
-  bufs_.reserve(num_bufs_);
+  init(num_bufs, size);
 }
 
-BufferManager::BufferManager(): i_(0)
+BufferManager::BufferManager(): num_bufs_(0), pool_(NULL), size_(0), stride_(0)
 {
   page_size_ = getpagesize();
 }
 
+BufferManager::~BufferManager()
+{
+  free(pool_);
+}
+
 void BufferManager::init(int num_bufs, size_t size)
 {
   num_bufs_ = num_bufs;
   size_ = size;
-  bufs_.reserve(num_bufs_);
+
+  /* Round every buffer up to a whole number of pages, so that each one
+     starts on a page boundary inside the pool.  */
+  stride_ = (size_ + page_size_ - 1) / page_size_ * page_size_;
+
+  free(pool_);
+  pool_ = (char*)(aligned_alloc(page_size_, stride_ * num_bufs_));
+  assert(pool_ != NULL);
+
+  iovecs_.resize(num_bufs_);
+  for (int i = 0; i < num_bufs_; i++)
+  {
+    iovecs_[i].iov_base = pool_ + i * stride_;
+    iovecs_[i].iov_len = size_;
+  }
+  free_all();
 }
 
-char* BufferManager::get_next_buf()
+int BufferManager::get_next_buf()
 {
-  if (i_ == num_bufs_) return NULL;
+  if (free_bufs_.empty()) return -1;
+
+  int idx = free_bufs_.back();
+  free_bufs_.pop_back();
+  return idx;
+}
 
-  char* buf = (char*)(malloc(size_));
-  bufs_.insert(buf);
-  i_++;
-  return buf;
+char* BufferManager::get_buf(int idx)
+{
+  assert(idx >= 0 && idx < num_bufs_);
+  return pool_ + idx * stride_;
 }
 
-void BufferManager::free_buf(char* buf)
+void BufferManager::free_buf(int idx)
 {
-  auto it = bufs_.find(buf);
-  if (it == bufs_.end()) return;
-  free(buf);
-  i_--;
-  bufs_.erase(it);
-  assert(i_ >= 0);
+  assert(idx >= 0 && idx < num_bufs_);
+  //! handed out after the others: the longer a freed buffer waits, the
+  //! likelier the requests still using it have completed
+  free_bufs_.insert(free_bufs_.begin(), idx);
+  assert(free_bufs_.size() <= (size_t)num_bufs_);
 }
 
 void BufferManager::free_all()
 {
-  for (auto ptr : bufs_)
+  //! hand out buffers in increasing order of index
+  free_bufs_.clear();
+  for (int i = num_bufs_ - 1; i >= 0; i--)
   {
-    free(ptr);
+    free_bufs_.push_back(i);
   }
-  bufs_.clear();
-  i_ = 0;
-}
\ No newline at end of file
+}
+
+size_t BufferManager::num_free()
+{
+  return free_bufs_.size();
+}
+
+const std::vector<struct iovec>& BufferManager::get_iovecs()
+{
+  return iovecs_;
+}
@@ -14,6 +14,7 @@
 #include <filesystem>
 
 #include "buffer-lcm.h"
+#include "zero-scan.h"
 #include "cxxopts.hpp"
 
 #define CHMOD_MODE_BITS \
@@ -27,10 +28,13 @@
 
 //! coreutils/cp.c hardcodes this to 128KiB
 enum { IO_BUFSIZE = 128 * 1024 };
+enum { SPARSE_NEVER, SPARSE_AUTO, SPARSE_ALWAYS };
 struct cp_options
 {
     bool recursive = false;
     size_t buf_size = IO_BUFSIZE;
+    //! keep holes (auto), or also make them of blocks of zeros (always)
+    int sparse = SPARSE_AUTO;
 };
 
 bool copy(const std::string& src_name, const std::string& dst_name, 
@@ -87,12 +91,14 @@ bool copy_dir(const std::string& src_name_in, const std::string& dst_name_in,
  * @param dst_name 
  * @param max_n_read 
  * @param total_n_read 
+ * @param hole_blk - 0, or skip over the blocks of this size that are all
+ *                   zeros instead of writing them, leaving holes
  * @return true sucessful completion
  * @return false 
  */
 bool sparse_copy(int src_fd, int dest_fd, char **abuf, size_t buf_size,
                  const std::string& src_name, const std::string& dst_name,
-                 uintmax_t max_n_read, off_t& total_n_read)
+                 uintmax_t max_n_read, off_t& total_n_read, size_t hole_blk)
 {
     if (!*abuf)
     {
@@ -121,11 +127,28 @@ bool sparse_copy(int src_fd, int dest_fd, char **abuf, size_t buf_size,
         total_n_read += n_read;
 
         //! loop over input buffer in chunks
-        //! TODO: Handle holes
+        //! holes are skipped by extent_copy, before we get here
         const char *ptr = (const char *)*abuf;
         while(n_read)
         {
-            ssize_t n_write = write(dest_fd, ptr, n_read);
+            size_t to_write = n_read;
+            if (hole_blk)
+            {
+                size_t n_zero = block_run(ptr, n_read, hole_blk, true);
+                if (n_zero)
+                {
+                    if (unlikely(lseek(dest_fd, n_zero, SEEK_CUR) < 0))
+                    {
+                        fprintf(stderr, "cannot lseek %s", dst_name.c_str());
+                        return false;
+                    }
+                    ptr += n_zero;
+                    n_read -= n_zero;
+                    continue;
+                }
+                to_write = block_run(ptr, n_read, hole_blk, false);
+            }
+            ssize_t n_write = write(dest_fd, ptr, to_write);
 
             if (unlikely(n_write < 0))
             {
@@ -147,6 +170,82 @@ bool sparse_copy(int src_fd, int dest_fd, char **abuf, size_t buf_size,
     return true;
 }
 
+/**
+ * @brief copy only the data extents of the regular file open on `src_fd`,
+ * hopping over its holes with SEEK_DATA/SEEK_HOLE; the holes are recreated
+ * by seeking past them in `dest_fd`, and a trailing one by ftruncate.
+ * Where the filesystem can't tell, the rest is copied as is.
+ * With `hole_blk`, blocks of zeros within the extents become holes too.
+ * 
+ * @param src_fd 
+ * @param dest_fd - must be empty
+ * @param abuf - as for sparse_copy
+ * @param buf_size 
+ * @param src_name 
+ * @param dst_name 
+ * @param src_size 
+ * @param total_n_read 
+ * @param hole_blk - as for sparse_copy
+ * @return true sucessful completion
+ * @return false 
+ */
+bool extent_copy(int src_fd, int dest_fd, char **abuf, size_t buf_size,
+                 const std::string& src_name, const std::string& dst_name,
+                 off_t src_size, off_t& total_n_read, size_t hole_blk)
+{
+    total_n_read = 0;
+    off_t pos = 0, end = src_size;
+
+    while (pos < src_size)
+    {
+        uintmax_t max_n_read;
+        off_t data = lseek(src_fd, pos, SEEK_DATA);
+        if (data < 0 && errno == ENXIO)
+        {
+            //! nothing but a hole up to EOF
+            break;
+        }
+        off_t hole = (data < 0) ? -1 : lseek(src_fd, data, SEEK_HOLE);
+        if (hole < 0)
+        {
+            //! not supported here
+            data = pos;
+            max_n_read = UINTMAX_MAX;
+        }
+        else
+        {
+            max_n_read = hole - data;
+        }
+
+        if (lseek(src_fd, data, SEEK_SET) < 0 || lseek(dest_fd, data, SEEK_SET) < 0)
+        {
+            fprintf(stderr, "cannot lseek %s", src_name.c_str());
+            return false;
+        }
+        off_t n_read;
+        if (!sparse_copy(src_fd, dest_fd, abuf, buf_size, src_name, dst_name, max_n_read, n_read,
+                         hole_blk))
+        {
+            return false;
+        }
+        total_n_read += n_read;
+        //! copied to EOF, or the file shrunk while copying
+        if (hole < 0 || (uintmax_t)n_read < max_n_read)
+        {
+            end = data + n_read;
+            break;
+        }
+        pos = hole;
+    }
+
+    if (ftruncate(dest_fd, end) != 0)
+    {
+        fprintf(stderr, "failed to extend %s", dst_name.c_str());
+        return false;
+    }
+    return true;
+}
+
 bool copy_reg(const std::string& src_name, const std::string& dst_name,
               int dst_dirfd, std::string_view dst_relname,
               const cp_options& opt,
@@ -242,8 +341,6 @@ bool copy_reg(const std::string& src_name, const std::string& dst_name,
         extra_permissions = 0;
     }
 
-    //! TODO: Add support for sparse files here!
-
     //! advise sequential read
     posix_fadvise(source_desc, 0, 0, POSIX_FADV_SEQUENTIAL);
 
@@ -271,8 +368,19 @@ bool copy_reg(const std::string& src_name, const std::string& dst_name,
     // {
     //     buf_size = blcm;
     // }
-    sparse_copy(source_desc, dest_desc, &buf, opt.buf_size,
-                src_name, dst_name, UINTMAX_MAX, n_read);
+    //! Sparse files: fewer blocks than their size takes
+    if (opt.sparse == SPARSE_ALWAYS ||
+        (opt.sparse == SPARSE_AUTO && (off_t)src_open_sb.st_blocks * 512 < src_open_sb.st_size))
+    {
+        const size_t hole_blk = (opt.sparse == SPARSE_ALWAYS) ? MAX((size_t)sb.st_blksize, (size_t)512) : 0;
+        return_val = extent_copy(source_desc, dest_desc, &buf, opt.buf_size,
+                                 src_name, dst_name, src_open_sb.st_size, n_read, hole_blk);
+    }
+    else
+    {
+        sparse_copy(source_desc, dest_desc, &buf, opt.buf_size,
+                    src_name, dst_name, UINTMAX_MAX, n_read, 0);
+    }
     //! TODO: --preserve timestamps, ownerships, xattr, author, acl
     //! TODO: remove extra permissions
 
@@ -546,6 +654,7 @@ int main(int argc, char** argv)
     options.add_options()
     ("r,recursive", "copy files recursively", cxxopts::value<bool>()->default_value("false"))
     ("b,buffersize", "size of buffer in KiB", cxxopts::value<size_t>())
+    ("sparse", "create holes in destination files: never|auto|always", cxxopts::value<std::string>())
     ("h,help", "Print usage");
 
     auto result = options.parse(argc, argv);
@@ -561,6 +670,27 @@ int main(int argc, char** argv)
     {
         cp_ops.buf_size = result["buffersize"].as<size_t>() * 1024;
     }
+    if (result.count("sparse"))
+    {
+        const auto& when = result["sparse"].as<std::string>();
+        if (when == "never")
+        {
+            cp_ops.sparse = SPARSE_NEVER;
+        }
+        else if (when == "auto")
+        {
+            cp_ops.sparse = SPARSE_AUTO;
+        }
+        else if (when == "always")
+        {
+            cp_ops.sparse = SPARSE_ALWAYS;
+        }
+        else
+        {
+            fprintf(stderr, "invalid argument %s for --sparse\n", when.c_str());
+            return EXIT_FAILURE;
+        }
+    }
     /**
      * Options not supported:
      * 1. -p: preserve perms
@@ -568,8 +698,7 @@ int main(int argc, char** argv)
      * 3. -L/-l: hardlinks deref
      * 4. -v: verbose
      * 5. --refline
-     * 6. --sparse
-     * 7. -Z: selinux stuff
+     * 6. -Z: selinux stuff
      * 
      * TODO: Add support for -t?
      * TODO: Add support for -T?
@@ -1,5 +1,7 @@
 #include <iostream>
 #include <vector>
+#include <deque>
+#include <algorithm>
 #include <string>
 #include <string_view>
 #include <cassert>
@@ -10,6 +12,12 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+
+//! FICLONE, FICLONERANGE
+#include <linux/fs.h>
 
 //! C++17 Filesystem for concat
 #include <filesystem>
@@ -17,8 +25,15 @@
 //! liburing
 #include <liburing.h>
 #include <atomic>
+#include <thread>
+#include <mutex>
 
 #include "buffer-lcm.h"
+#include "getdents.h"
+#include "wait-policy.h"
+#include "work-pool.h"
+#include "zero-scan.h"
+#include "fiemap.h"
 #include "cxxopts.hpp"
 
 #define CHMOD_MODE_BITS \
@@ -33,19 +48,78 @@
 //! Must be >= 2
 #define RINGSIZE (1 << 14)
 
-//! Must be a multiple of 2
-#define MAX_OPEN_FILES 50
+//! Must be a multiple of 4: a file holds up to 4 descriptors
+//! (src, dst and either the two ends of a splice pipe or their
+//! O_DIRECT counterparts)
+#define MAX_OPEN_FILES 256
+
+//! # of files whose metadata requests are in flight together
+#define META_BATCH (MAX_OPEN_FILES / 4)
+
+//! # of directories being listed at once
+#define MAX_DIR_READS 16
 
 //! coreutils/cp.c hardcodes this to 128KiB
 //! We use this as the default bufsize
 enum { IO_BUFSIZE = 128 * 1024 };
 
-struct {
+struct work_item;
+
+//! A chain of data requests in flight, looked up by the index its
+//! user_data carries once its cqe arrives
+struct data_chain
+{
+    //! bytes its last request has to transfer, anything else is an error
+    unsigned expected;
+    //! # of chunks, given back to the budgets of its devices in ctx.devs
+    unsigned n_chunks;
+    int src_dev;
+    int dst_dev;
+    //! index of the buffer in ctx.buf_mgr it uses, -1 for none
+    int buf;
+};
+
+//! Chunks in flight on a block device: being read from it, and being
+//! written to it, each held to its own budget
+struct dev_budget
+{
+    dev_t dev;
+    unsigned reading;
+    unsigned writing;
+};
+
+//! Per thread: with `-j`, every thread has its own ring, buffers and files
+thread_local struct {
+    struct io_uring iou;
     struct io_uring* ring;
+    //! # of read/write chains in flight; each posts a single cqe
     unsigned pending_cqe;
+    //! # of chains that failed or were cut short
+    unsigned data_errors;
+    //! # of metadata requests queued or in flight
+    unsigned pending_meta;
     std::vector<int> open_fds;
     unsigned page_size;
     BufferManager buf_mgr;
+    //! true if buf_mgr's pool is registered with the ring
+    bool fixed_bufs;
+    //! true if the kernel can't do getdents64 through the ring
+    bool sync_getdents;
+    WaitPolicy waiter;
+    //! work shared with the other threads, NULL when running alone
+    work_pool<work_item>* pool;
+    int worker_id;
+    //! devices that files were copied from/to, by st_dev
+    std::vector<dev_budget> devs;
+    //! data chains by index, and the indices free for new chains
+    std::vector<data_chain> chains;
+    std::vector<uint32_t> free_chains;
+    //! # of chains started so far, to tell if a round queued anything
+    uint64_t n_chains;
+    //! # of chains in flight per buffer of ctx.buf_mgr
+    std::vector<unsigned> buf_chains;
+    //! --phys_order: where on the source device the last file queued starts
+    uint64_t phys_head;
     // char* buf;
 } ctx;
 
@@ -58,23 +132,136 @@ void close_all_files()
     ctx.open_fds.clear();
 }
 
+//! Kind of a data request. Metadata requests instead carry a pointer to
+//! the `int` that receives their result.
+//! Only the last request of a chain (tagged UD_LAST) posts a cqe on success,
+//! the others are queued with IOSQE_CQE_SKIP_SUCCESS. When one of them
+//! fails or comes up short it posts its cqe instead, and the rest of the
+//! chain is cancelled without cqes: either way one cqe per chain.
+//! UD_DROP are the page cache requests of --drop_behind.
+enum { UD_READ = 1, UD_WRITE, UD_DROP, UD_MAX };
+#define UD_LAST 0x80
+
+//! user_data of data requests: UD_DATA, which no user space pointer has,
+//! the kind, and the index of the chain in ctx.chains
+#define UD_DATA (1ULL << 63)
+
+static inline uint64_t data_ud(int kind, uint32_t chain)
+{
+    return UD_DATA | kind | ((uint64_t)chain << 8);
+}
+
+/**
+ * @brief start a chain of data requests of `n_chunks` chunks between two
+ * devices of ctx.devs, through buffer `buf`; its `expected` is set once its
+ * last request is known
+ * 
+ * @return its index, for data_ud
+ */
+static inline uint32_t new_chain(unsigned n_chunks, int src_dev, int dst_dev, int buf = -1)
+{
+    uint32_t idx;
+    if (!ctx.free_chains.empty())
+    {
+        idx = ctx.free_chains.back();
+        ctx.free_chains.pop_back();
+    }
+    else
+    {
+        idx = ctx.chains.size();
+        ctx.chains.emplace_back();
+    }
+    ctx.chains[idx] = {0, n_chunks, src_dev, dst_dev, buf};
+    ctx.n_chains++;
+    if (buf >= 0)
+    {
+        ctx.buf_chains[buf]++;
+    }
+    return idx;
+}
+
+/**
+ * @brief index of `dev` in ctx.devs, adding it the first time
+ */
+static int dev_index(dev_t dev)
+{
+    for (size_t i = 0; i < ctx.devs.size(); i++)
+    {
+        if (ctx.devs[i].dev == dev) return i;
+    }
+    ctx.devs.push_back({dev, 0, 0});
+    return ctx.devs.size() - 1;
+}
+
+static inline void reap_cqe(struct io_uring_cqe* cqe)
+{
+    if (cqe->user_data & UD_DATA)
+    {
+        const int kind = cqe->user_data & 0x7f;
+        const uint32_t idx = (uint32_t)(cqe->user_data >> 8);
+        const data_chain& chain = ctx.chains[idx];
+        //! a short last request fails the chain too: a partial write on a
+        //! full disk still posts res >= 0
+        if (unlikely(cqe->res < 0 || !(cqe->user_data & UD_LAST) ||
+                     (unsigned)cqe->res != chain.expected))
+        {
+            static const char* const names[UD_MAX] = {"", "read", "write", "drop-behind"};
+            fprintf(stderr, "%s failed: %s\n", names[kind],
+                    cqe->res < 0 ? strerror(-cqe->res) : "short transfer");
+            ctx.data_errors++;
+        }
+        ctx.devs[chain.src_dev].reading -= chain.n_chunks;
+        ctx.devs[chain.dst_dev].writing -= chain.n_chunks;
+        if (chain.buf >= 0)
+        {
+            ctx.buf_chains[chain.buf]--;
+        }
+        ctx.free_chains.push_back(idx);
+        ctx.pending_cqe--;
+    }
+    else
+    {
+        *(int*)io_uring_cqe_get_data(cqe) = cqe->res;
+        ctx.pending_meta--;
+    }
+}
+
+/**
+ * @brief wait for at least one cqe, then reap everything that has been
+ * posted with a single CQ head update
+ */
+static inline void reap_batch()
+{
+    struct io_uring_cqe* cqes[REAP_BATCH];
+    struct io_uring_cqe* cqe = NULL;
+    int ret = ctx.waiter.wait_cqe(ctx.ring, &cqe);
+    if (unlikely(ret < 0))
+    {
+        fprintf(stderr, "io_uring_wait_cqe: %s\n", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+    unsigned n = io_uring_peek_batch_cqe(ctx.ring, cqes, REAP_BATCH);
+    for (unsigned i = 0; i < n; i++)
+    {
+        reap_cqe(cqes[i]);
+    }
+    io_uring_cq_advance(ctx.ring, n);
+}
+
+/**
+ * @brief wait for `num_cqes` chains of data requests to complete;
+ * metadata completions that arrive in between are recorded as well
+ */
 int handle_cqes(unsigned num_cqes)
 {
     if (num_cqes == 0) return 0;
     assert(ctx.pending_cqe >= num_cqes);
-    struct io_uring_cqe* cqe = NULL;
     int ret = 0;
-    
-    int remaining = num_cqes;
-    while (remaining > 0)
+
+    const unsigned target = ctx.pending_cqe - num_cqes;
+    while (ctx.pending_cqe > target)
     {
-        io_uring_peek_cqe(ctx.ring, &cqe);
-        if (cqe)
-        {
-            io_uring_cq_advance(ctx.ring, 1);
-            cqe = NULL;
-            remaining--;
-        }
+        reap_batch();
     }
     // int ret = io_uring_wait_cqe_nr(ctx.ring, &cqe, num_cqes);
     // assert(cqe);
@@ -87,11 +274,45 @@ int handle_cqes(unsigned num_cqes)
     // //! TODO: free buffer when a file is done
     // //!       "TAG" the last 'write' with buf ptr, and when that is detected, free the corresponding buffer!
 
-    
-    ctx.pending_cqe -= num_cqes;
     return ret;
 }
 
+/**
+ * @brief wait for the chains that still use any of `bufs`, leaving those
+ * of other files in flight
+ */
+void wait_bufs(const std::vector<int>& bufs)
+{
+    for (int buf : bufs)
+    {
+        while (ctx.buf_chains[buf] > 0)
+        {
+            reap_batch();
+        }
+    }
+}
+
+/**
+ * @brief submit the queued metadata requests and wait for all of them
+ */
+int wait_meta()
+{
+    int ret = io_uring_submit(ctx.ring);
+    if (unlikely(ret < 0))
+    {
+        fprintf(stderr, "io_uring_submit: %s\n", strerror(-ret));
+        return ret;
+    }
+    while (ctx.pending_meta > 0)
+    {
+        reap_batch();
+    }
+    return 0;
+}
+
+enum { REFLINK_NEVER, REFLINK_AUTO, REFLINK_ALWAYS };
+enum { SPARSE_NEVER, SPARSE_AUTO, SPARSE_ALWAYS };
+
 struct cp_options
 {
     bool recursive = false;
@@ -99,319 +320,1985 @@ struct cp_options
     unsigned ktime = 60000;
     size_t buf_size = IO_BUFSIZE;
     int num_bufs = 2;
+    //! # of buffers a single file's chunks rotate through
+    int chunk_bufs = 1;
     size_t ring_size = RINGSIZE;
+    //! copy_file_range/splice instead of reading into our own buffers
+    bool zerocopy = false;
+    int reflink = REFLINK_NEVER;
+    unsigned spin_us = DEFAULT_SPIN_US;
+    bool wait_stats = false;
+    //! # of threads copying directories, each with its own ring
+    int n_threads = 1;
+    //! max # of chunks in flight per device, 0 for no limit but the ring's.
+    //! Each ring keeps its own count: copy_dirs_parallel splits it between
+    //! the threads
+    unsigned dev_depth = 0;
+    //! io-wq worker limits per ring, bounded (regular files) and unbounded
+    unsigned iowq_workers[2] = {0, 0};
+    //! files of at least this many bytes bypass the page cache, 0 for never
+    size_t direct_min = 0;
+    //! drop copied data from the page cache, with at most this many bytes
+    //! per buffer dirty; 0 to leave the page cache alone
+    size_t drop_window = 0;
+    //! keep holes (auto), or also make them of blocks of zeros (always)
+    int sparse = SPARSE_AUTO;
+    //! queue the files of a batch by the physical location of their data
+    bool phys_order = false;
 };
 
-bool copy(const std::string& src_name, const std::string& dst_name, 
-          int dst_dirfd, std::string_view dst_relname, 
-          bool nonexistent_dst, cp_options& opt);
-
-bool copy_dir(const std::string& src_name_in, const std::string& dst_name_in,
-              int dst_dirfd, std::string_view dst_relname_in, bool new_dst,
-              const struct stat* src_sb, cp_options& opt)
+/**
+ * @brief get an sqe for a metadata request whose result goes to `*res`
+ */
+struct io_uring_sqe* get_meta_sqe(int* res, cp_options& opt)
 {
-    DIR* dirp = opendir(src_name_in.c_str());
-    if (!dirp)
+    //! Keep everything in flight within the ring, so the CQ can't overflow
+    while (ctx.pending_cqe + ctx.pending_meta >= opt.ring_size)
     {
-        fprintf(stderr, "cannot access %s", src_name_in.c_str());
-        return false;
+        io_uring_submit(ctx.ring);
+        reap_batch();
     }
+    struct io_uring_sqe* sqe = io_uring_get_sqe(ctx.ring);
+    assert(sqe);
+    io_uring_sqe_set_data(sqe, res);
+    ctx.pending_meta++;
+    return sqe;
+}
+
+static void statx_to_stat(const struct statx& stx, struct stat& sb)
+{
+    memset(&sb, 0, sizeof(sb));
+    sb.st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    sb.st_ino = stx.stx_ino;
+    sb.st_mode = stx.stx_mode;
+    sb.st_nlink = stx.stx_nlink;
+    sb.st_uid = stx.stx_uid;
+    sb.st_gid = stx.stx_gid;
+    sb.st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+    sb.st_size = stx.stx_size;
+    sb.st_blksize = stx.stx_blksize;
+    sb.st_blocks = stx.stx_blocks;
+    sb.st_atim.tv_sec = stx.stx_atime.tv_sec;
+    sb.st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+    sb.st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+    sb.st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+    sb.st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+    sb.st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+}
 
+//! A file/dir to copy, along with the results of its async metadata requests
+struct copy_entry
+{
+    std::string src_name;
+    std::string dst_name;
+    //! `dst_name + dst_rel_off` is the name relative to the top dst_dirfd
+    size_t dst_rel_off = 0;
+    //! Entries of a listed directory are stat'ed/opened relative to the
+    //! fds of their parents, so the kernel only looks up the last component
+    int src_dirfd = AT_FDCWD;
+    size_t src_at_off = 0;
+    int dst_dirfd = AT_FDCWD;
+    size_t dst_at_off = 0;
+    bool nonexistent_dst = false;
+    bool new_dst = false;
     bool ok = true;
-    for(;;)
+    bool made_dir = false;
+    int src_res = 0;
+    int dst_res = 0;
+    struct statx src_stx;
+    struct statx dst_stx;
+    struct stat src_sb;
+    struct stat dst_sb;
+    mode_t dst_mode_bits = 0;
+    mode_t omitted_permissions = 0;
+    mode_t extra_permissions = 0;
+    int src_fd = -1;
+    int dst_fd = -1;
+
+    //! name relative to src_dirfd
+    const char* src_relname() const
     {
-        struct dirent const* dp;
-        const char* entry;
-        dp = readdir(dirp);
-        if (!dp) break;
+        return src_name.c_str() + src_at_off;
+    }
 
-        entry = dp->d_name;
+    //! name relative to dst_dirfd
+    const char* dst_relname() const
+    {
+        return dst_name.c_str() + dst_at_off;
+    }
+};
 
-        /* Skip "", ".", and "..". */
-        if (entry[entry[0] != '.' ? 0 : entry[1] != '.' ? 1 : 2] == '\0') continue;
+//! A source directory to list, and where its entries are copied to
+struct dir_job
+{
+    std::string src_name;
+    std::string dst_name;
+    //! same as copy_entry::dst_rel_off
+    size_t dst_rel_off = 0;
+    //! passed on as the entries' copy_entry::nonexistent_dst
+    bool new_dst = false;
+    int fd = -1;
+    //! O_PATH fd of the destination directory, or < 0 if it couldn't be
+    //! opened; then the entries fall back to the top dst_dirfd
+    int dst_fd = -1;
+    //! result of the outstanding getdents
+    int res = 0;
+    //! position to continue reading from
+    uint64_t pos = 0;
+    //! index of the dirent buffer used for this directory
+    int buf = -1;
+};
 
-        bool local_copy_into_self;
-        std::string src_name = (std::filesystem::path(src_name_in) / entry);
-        std::string dst_name = (std::filesystem::path(dst_name_in) / entry);
+//! A unit of work shared between threads: a directory to list, or, if
+//! `entries` isn't empty, a batch of entries of a big directory. Entries
+//! are detached from the fds of their directory, which its thread owns.
+struct work_item
+{
+    dir_job dir;
+    std::vector<copy_entry> entries;
+};
 
-        ok &= copy(src_name, dst_name, dst_dirfd,
-                   dst_name.c_str() + (dst_name_in.length() - dst_relname_in.length()),
-                   new_dst, opt);
+static inline void prep_read_buf(struct io_uring_sqe* sqe, int fd, int buf_idx,
+                                 unsigned nbytes, off_t offset)
+{
+    char* buf = ctx.buf_mgr.get_buf(buf_idx);
+    if (ctx.fixed_bufs)
+    {
+        io_uring_prep_read_fixed(sqe, fd, buf, nbytes, offset, buf_idx);
+    }
+    else
+    {
+        io_uring_prep_read(sqe, fd, buf, nbytes, offset);
     }
+}
 
-    return ok;
+static inline void prep_write_buf(struct io_uring_sqe* sqe, int fd, int buf_idx,
+                                  unsigned nbytes, off_t offset, size_t buf_off = 0)
+{
+    char* buf = ctx.buf_mgr.get_buf(buf_idx) + buf_off;
+    if (ctx.fixed_bufs)
+    {
+        io_uring_prep_write_fixed(sqe, fd, buf, nbytes, offset, buf_idx);
+    }
+    else
+    {
+        io_uring_prep_write(sqe, fd, buf, nbytes, offset);
+    }
 }
 
+bool copy_batch(std::vector<copy_entry>& entries, std::deque<dir_job>& dirs,
+                cp_options& opt);
+
 /**
- * @brief copy regular file open on `src_fd` to `dst_fd`
- * *abuf for temp storage, allocating it lazily
- * copy no more than `max_n_read` bytes
- * 
- * @param src_fd 
- * @param dest_fd
- * @param abuf - this is to reuse the same buffer if it was 
- *               allocated in a prev call to sparse_copy
- * @param buf_size 
- * @param src_name 
- * @param dst_name 
- * @param max_n_read 
- * @param total_n_read 
- * @return true sucessful completion
- * @return false 
+ * @brief read the next entries of `d` synchronously with getdents64(2)
  */
-bool sparse_copy(int src_fd, int dest_fd, char *buf, size_t buf_size,
-                 const std::string& src_name, const std::string& dst_name,
-                 const size_t filesize, off_t& total_n_read, cp_options& opt)
+static void getdents_sync(dir_job& d, uint8_t* buf)
 {
-    // if (!*abuf)
-    // {
-    //     *abuf = (char *)aligned_alloc(getpagesize(), buf_size);
-    //     if (unlikely(*abuf == NULL))
-    //     {
-    //         fprintf(stderr, "failed to allocate memory for buffer %d %ld", getpagesize(), buf_size);
-    //         return false;
-    //     }
-    // }
-    total_n_read = 0;
-    off_t psize = 0;
+    long n = syscall(SYS_getdents64, d.fd, buf, DIR_BUF_SIZE);
+    d.res = (n < 0) ? -errno : n;
+}
+
+/**
+ * @brief move `dirs` to the pool, if there is one
+ */
+static void share_dirs(std::deque<dir_job>& dirs)
+{
+    if (!ctx.pool) return;
+    work_item w;
+    while (!dirs.empty())
+    {
+        w.dir = std::move(dirs.front());
+        dirs.pop_front();
+        ctx.pool->push(ctx.worker_id, std::move(w));
+    }
+}
+
+/**
+ * @brief hand a batch of entries to an idle thread. The fds of their
+ * directory belong to this thread, so they are found by name instead.
+ */
+static void share_batch(std::vector<copy_entry>& entries, int dst_dirfd)
+{
+    work_item w;
+    w.entries = std::move(entries);
+    for (auto& e : w.entries)
+    {
+        e.src_dirfd = AT_FDCWD;
+        e.src_at_off = 0;
+        e.dst_dirfd = dst_dirfd;
+        e.dst_at_off = e.dst_rel_off;
+    }
+    ctx.pool->push(ctx.worker_id, std::move(w));
+    entries = std::vector<copy_entry>();
+    entries.reserve(META_BATCH);
+}
 
+/**
+ * @brief copy the contents of the directories in `dirs`, and of the
+ * directories found in them
+ * 
+ * Instead of recursing, directories wait in `dirs` and up to MAX_DIR_READS
+ * of them are listed at once: every round has one getdents64 in flight per
+ * open directory, and the entries they return go straight to copy_batch.
+ * 
+ * With ctx.pool set, directories go through the pool instead of `dirs`,
+ * and full batches of entries too while other threads are idle; this
+ * returns once the pool has run out of work.
+ * 
+ * @param dirs 
+ * @param dst_dirfd 
+ * @return bool
+ */
+bool copy_dirs(std::deque<dir_job>& dirs, int dst_dirfd, cp_options& opt)
+{
     struct io_uring_sqe* sqe;
-    size_t bytes_left = filesize;
-    unsigned num_cqes = 0;
-    bool unsubmitted_sqe = false;
-    while(bytes_left)
+    bool ok = true;
+
+    //! `active` never grows past MAX_DIR_READS, so the result slots handed
+    //! to the ring stay put
+    std::vector<dir_job> active;
+    active.reserve(MAX_DIR_READS);
+    std::vector<std::vector<uint8_t>> bufs(MAX_DIR_READS, std::vector<uint8_t>(DIR_BUF_SIZE));
+    std::vector<int> free_bufs;
+    for (int i = MAX_DIR_READS - 1; i >= 0; i--)
     {
-        //! Free up ring queue
-        unsigned available_sqe = opt.ring_size - ctx.pending_cqe;
-        unsigned needed_sqe = MIN(opt.ring_size, 2 * ((bytes_left / buf_size) + ((bytes_left % buf_size) != 0)));
-        if (needed_sqe > available_sqe)
+        free_bufs.push_back(i);
+    }
+    std::vector<copy_entry> entries;
+    entries.reserve(META_BATCH);
+    std::vector<struct linux_dirent64*> dents;
+
+    work_item w;
+    while (!dirs.empty() || !active.empty() || (ctx.pool && !ctx.pool->finished()))
+    {
+        //! 1. open more directories
+        share_dirs(dirs);
+        size_t first_new = active.size();
+        while (active.size() < MAX_DIR_READS)
         {
-            if (unsubmitted_sqe)
+            if (ctx.pool)
             {
-                int ret = io_uring_submit(ctx.ring);
-                if (unlikely(ret < 0))
+                if (!ctx.pool->pop(ctx.worker_id, w)) break;
+                if (!w.entries.empty())
                 {
-                    fprintf(stderr, "io_uring_submit: %s\n", strerror(-ret));
-                    return false;
+                    ok &= copy_batch(w.entries, dirs, opt);
+                    w.entries.clear();
+                    share_dirs(dirs);
+                    ctx.pool->done();
+                    continue;
                 }
-                unsubmitted_sqe = false;
+                dirs.push_back(std::move(w.dir));
             }
-            
-            //! TODO: Maybe MIN(NUM_FREE_AT_ONCE, needed_sqe - available_sqe) will work better
-            //!       or maybe MIN(pending_cqe, NUM_FREE_AT_ONCE)??
-            int ret = handle_cqes(needed_sqe - available_sqe);
-            if (unlikely(ret) < 0)
+            if (dirs.empty()) break;
+            active.push_back(std::move(dirs.front()));
+            dirs.pop_front();
+            auto& d = active.back();
+            sqe = get_meta_sqe(&d.fd, opt);
+            io_uring_prep_openat(sqe, AT_FDCWD, d.src_name.c_str(), O_RDONLY | O_DIRECTORY, 0);
+            sqe = get_meta_sqe(&d.dst_fd, opt);
+            io_uring_prep_openat(sqe, dst_dirfd, d.dst_name.c_str() + d.dst_rel_off,
+                                 O_PATH | O_DIRECTORY, 0);
+        }
+        if (active.size() > first_new && wait_meta() < 0) return false;
+        if (active.empty())
+        {
+            //! the pool is out of work for now, but not done
+            if (ctx.pool && dirs.empty()) ctx.pool->idle();
+            continue;
+        }
+
+        //! 2. one getdents for every open directory
+        for (size_t i = first_new; i < active.size(); i++)
+        {
+            auto& d = active[i];
+            if (d.fd >= 0)
             {
-                return false;
+                d.buf = free_bufs.back();
+                free_bufs.pop_back();
+            }
+        }
+        for (auto& d : active)
+        {
+            if (d.fd < 0) continue;
+            if (ctx.sync_getdents)
+            {
+                getdents_sync(d, bufs[d.buf].data());
+                continue;
             }
-            available_sqe = needed_sqe;
+            sqe = get_meta_sqe(&d.res, opt);
+            io_uring_prep_getdents64(sqe, d.fd, bufs[d.buf].data(), DIR_BUF_SIZE, d.pos);
         }
+        if (!ctx.sync_getdents && wait_meta() < 0) return false;
 
-        // handle_cqes(ctx.pending_cqe);
-        //! Queue RW requests
-        unsigned num_used = 0;
-        while ((num_used < available_sqe) && bytes_left)
+        //! 3. feed the entries to the copy path
+        for (auto& d : active)
         {
-            size_t bytes_to_read = MIN(buf_size, bytes_left);
-            sqe = io_uring_get_sqe(ctx.ring);
-            assert(sqe);
+            if (d.fd < 0)
+            {
+                fprintf(stderr, "cannot access %s", d.src_name.c_str());
+                ok = false;
+                continue;
+            }
+            if (d.res < 0)
+            {
+                fprintf(stderr, "cannot access %s", d.src_name.c_str());
+                ok = false;
+                d.res = 0;
+                continue;
+            }
 
-            // ssize_t n_read = read(src_fd, *abuf, MIN(max_n_read, buf_size));
-            io_uring_prep_read(sqe, src_fd, buf, bytes_to_read, -1);
-            io_uring_sqe_set_data64(sqe, 1);
-            sqe->flags |= IOSQE_IO_LINK;
-            total_n_read += bytes_to_read;
-            num_used++;
+            //! Entries go in inode order rather than the directory's hash
+            //! order: on ext4 and XFS neighbouring inodes share inode table
+            //! blocks, so the statx/opens of a batch read them in sequence
+            uint8_t* bufp = bufs[d.buf].data();
+            uint8_t* end = bufp + d.res;
+            dents.clear();
+            while (bufp < end)
+            {
+                struct linux_dirent64* dent = (struct linux_dirent64*)bufp;
+                bufp += dent->d_reclen;
+                //! the next getdents goes on after the last one in directory order
+                d.pos = dent->d_off;
+                dents.push_back(dent);
+            }
+            std::sort(dents.begin(), dents.end(),
+                      [](const linux_dirent64* a, const linux_dirent64* b)
+                      {
+                          return a->d_ino < b->d_ino;
+                      });
 
-            sqe = io_uring_get_sqe(ctx.ring);
-            assert(sqe);
-            io_uring_prep_write(sqe, dest_fd, buf, bytes_to_read, -1);
-            io_uring_sqe_set_data64(sqe, 2);
-            sqe->flags |= IOSQE_IO_LINK;
-            num_used++;
+            for (struct linux_dirent64* dent : dents)
+            {
+                const char* entry = dent->d_name;
+                /* Skip "", ".", and "..". */
+                if (entry[entry[0] != '.' ? 0 : entry[1] != '.' ? 1 : 2] == '\0') continue;
+
+                auto& e = entries.emplace_back();
+                e.src_name = (std::filesystem::path(d.src_name) / entry);
+                e.dst_name = (std::filesystem::path(d.dst_name) / entry);
+                e.dst_rel_off = d.dst_rel_off;
+                e.src_dirfd = d.fd;
+                e.src_at_off = e.src_name.length() - strlen(entry);
+                if (d.dst_fd >= 0)
+                {
+                    e.dst_dirfd = d.dst_fd;
+                    e.dst_at_off = e.dst_name.length() - strlen(entry);
+                }
+                else
+                {
+                    e.dst_dirfd = dst_dirfd;
+                    e.dst_at_off = e.dst_rel_off;
+                }
+                e.nonexistent_dst = d.new_dst;
 
-            bytes_left -= bytes_to_read;
+                //! Entries are copied in batches, whose metadata requests are all
+                //! in flight together
+                if (entries.size() == META_BATCH)
+                {
+                    if (ctx.pool && ctx.pool->has_idle())
+                    {
+                        share_batch(entries, dst_dirfd);
+                    }
+                    else
+                    {
+                        ok &= copy_batch(entries, dirs, opt);
+                    }
+                    entries.clear();
+                }
+            }
+        }
+        if (!entries.empty())
+        {
+            ok &= copy_batch(entries, dirs, opt);
+            entries.clear();
         }
 
-        //! Update state
-        unsubmitted_sqe = true;
-        ctx.pending_cqe += num_used;
+        //! 4. retire the directories that are fully read; copy_batch is
+        //! done with their fds. Their subdirectories go to the pool first.
+        share_dirs(dirs);
+        for (size_t i = 0; i < active.size();)
+        {
+            auto& d = active[i];
+            if (d.fd < 0 || d.res == 0)
+            {
+                if (d.fd >= 0)
+                {
+                    close(d.fd);
+                    free_bufs.push_back(d.buf);
+                }
+                if (d.dst_fd >= 0)
+                {
+                    close(d.dst_fd);
+                }
+                if (ctx.pool)
+                {
+                    ctx.pool->done();
+                }
+                d = std::move(active.back());
+                active.pop_back();
+                continue;
+            }
+            i++;
+        }
     }
-    
-    int ret = io_uring_submit(ctx.ring);
-    if (unlikely(ret < 0))
+
+    return ok;
+}
+
+/**
+ * @brief make room in the ring for up to `needed_sqe` more requests
+ * 
+ * @param needed_sqe 
+ * @param drain - wait for everything in flight, e.g. before reusing
+ *                pipes still used by a previous batch
+ * @return # of sqes that can be queued, < 0 on error
+ */
+int reserve_sqes(size_t needed_sqe, bool drain, cp_options& opt)
+{
+    needed_sqe = MIN(opt.ring_size, needed_sqe);
+    //! Each chain of >= 2 requests posts one cqe, keep them within the ring
+    //! so the CQ can't overflow
+    const unsigned needed_cqe = needed_sqe / 2;
+    if (drain)
     {
-        fprintf(stderr, "io_uring_submit: %s\n", strerror(-ret));
-        return false;
+        int ret = handle_cqes(ctx.pending_cqe);
+        if (unlikely(ret < 0))
+        {
+            return ret;
+        }
     }
-    
-    return true;
+    else if (ctx.pending_cqe + needed_cqe > opt.ring_size)
+    {
+        //! TODO: Maybe MIN(NUM_FREE_AT_ONCE, needed_sqe - available_sqe) will work better
+        //!       or maybe MIN(pending_cqe, NUM_FREE_AT_ONCE)??
+        int ret = handle_cqes(ctx.pending_cqe + needed_cqe - opt.ring_size);
+        if (unlikely(ret < 0))
+        {
+            return ret;
+        }
+    }
+    //! With SQPOLL, earlier batches may still sit in the SQ; a chain can't
+    //! be split across submissions, so wait for room for all of it
+    while (io_uring_sq_space_left(ctx.ring) < needed_sqe)
+    {
+        io_uring_submit(ctx.ring);
+        io_uring_sqring_wait(ctx.ring);
+    }
+    return needed_sqe;
+}
+
+/**
+ * @brief # of chunks that can be read from `src_dev` and written to
+ * `dst_dev` within their budgets; doesn't wait. At 0 the file steps aside
+ * (see copy_batch), so a slow device can't hold back the others.
+ * 
+ * @param src_dev - index in ctx.devs
+ * @param dst_dev 
+ */
+size_t dev_room(int src_dev, int dst_dev, cp_options& opt)
+{
+    if (opt.dev_depth == 0) return SIZE_MAX;
+    const unsigned reading = ctx.devs[src_dev].reading;
+    const unsigned writing = ctx.devs[dst_dev].writing;
+    if (reading >= opt.dev_depth || writing >= opt.dev_depth) return 0;
+    return opt.dev_depth - MAX(reading, writing);
+}
+
+/**
+ * @brief count `n_chunks` more chunks being read from `src_dev` and
+ * written to `dst_dev`
+ */
+static inline void dev_take(int src_dev, int dst_dev, unsigned n_chunks)
+{
+    ctx.devs[src_dev].reading += n_chunks;
+    ctx.devs[dst_dev].writing += n_chunks;
+}
+
+//! [start, end) of a file
+struct extent
+{
+    off_t start;
+    off_t end;
+};
+
+/**
+ * @brief the parts of [from, to) of `fd` that hold data, as found with
+ * SEEK_DATA/SEEK_HOLE, each widened to multiples of `align` (e.g. for
+ * O_DIRECT); holes in between are left out
+ * 
+ * @return false if the filesystem can't tell, `out` is then meaningless
+ */
+static bool data_extents(int fd, off_t from, off_t to, off_t align, std::vector<extent>& out)
+{
+    out.clear();
+    off_t pos = from;
+    while (pos < to)
+    {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if (data < 0)
+        {
+            //! nothing but a hole up to EOF
+            if (errno == ENXIO) break;
+            return false;
+        }
+        if (data >= to) break;
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0)
+        {
+            return false;
+        }
+        const off_t ext_start = MAX(from, data / align * align);
+        const off_t ext_end = MIN(to, (hole + align - 1) / align * align);
+        if (!out.empty() && ext_start <= out.back().end)
+        {
+            out.back().end = MAX(out.back().end, ext_end);
+        }
+        else
+        {
+            out.push_back({ext_start, ext_end});
+        }
+        pos = hole;
+    }
+    return true;
+}
+
+/**
+ * @brief copy the `extents` of the regular file open on `src_fd` to
+ * `dst_fd`; what lies between them is left alone, i.e. stays a hole in
+ * a freshly created/truncated destination
+ * 
+ * @param src_fd 
+ * @param dest_fd
+ * @param src_dev - indices in ctx.devs of the devices of both files
+ * @param dst_dev
+ * @param bufs - indices of the buffers in ctx.buf_mgr that the file's
+ *               chunks rotate through; they double as the registered
+ *               buffer indices when ctx.fixed_bufs is set
+ * @param buf_size 
+ * @param src_name 
+ * @param dst_name 
+ * @param extents - in: sorted, non-overlapping ranges to copy, out: those
+ *                  left when `blocked`
+ * @param total_n_read 
+ * @param drop_window - 0, or drop what was copied from the page cache and
+ *                      keep no more than about this many bytes per buffer
+ *                      dirty (--drop_behind)
+ * @param blocked - set if the devices ran out of budget before all was
+ *                  queued; called again with the extents left, it goes on
+ * @return true sucessful completion, or blocked
+ * @return false 
+ */
+bool sparse_copy(int src_fd, int dest_fd, int src_dev, int dst_dev,
+                 const std::vector<int>& bufs, size_t buf_size,
+                 const std::string& src_name, const std::string& dst_name,
+                 std::vector<extent>& extents, off_t& total_n_read,
+                 size_t drop_window, bool& blocked, cp_options& opt)
+{
+    blocked = false;
+    total_n_read = 0;
+    const size_t n_bufs = bufs.size();
+    size_t n_chunks = 0;
+    for (const auto& ext : extents)
+    {
+        const size_t n_bytes = ext.end - ext.start;
+        n_chunks += (n_bytes / buf_size) + ((n_bytes % buf_size) != 0);
+    }
+    if (n_chunks == 0)
+    {
+        extents.clear();
+        return true;
+    }
+    //! --drop_behind: the chunk `window` chunks back on the same chain is
+    //! the oldest one allowed to be dirty. A multiple of n_bufs, so it was
+    //! written by an earlier link of this very chain (or an earlier batch).
+    const bool drop = (drop_window != 0);
+    size_t window = MAX(drop_window / buf_size, (size_t)1);
+    window = (window + n_bufs - 1) / n_bufs * n_bufs;
+    //! sqes per chunk, and per chain to flush what is left at the end
+    const size_t chunk_sqes = drop ? 6 : 2;
+    const size_t tail_sqes = drop ? 2 : 0;
+    //! with drop: chunk c's range is at [c % window], until chunk c + window
+    //! replaces it; chains own disjoint slots as window % n_bufs == 0
+    std::vector<extent> recent(drop ? MIN(window, n_chunks) : 0);
+    //! ranges of the chunks of the current batch, in file order
+    std::vector<extent> ranges;
+    size_t ext_idx = 0;
+    off_t ext_pos = extents.empty() ? 0 : extents[0].start;
+
+    struct io_uring_sqe* sqe;
+    //! all but the last request of a chain
+    auto link = [&](struct io_uring_sqe* req, int kind, uint32_t chain)
+    {
+        io_uring_sqe_set_data64(req, data_ud(kind, chain));
+        req->flags |= IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+    };
+    auto get_sqe = []()
+    {
+        struct io_uring_sqe* req = io_uring_get_sqe(ctx.ring);
+        assert(req);
+        return req;
+    };
+    //! wait for the writeback of a written range and drop it from the
+    //! cache; a length of 0 means up to EOF for both
+    auto flush_range = [&](off_t offset, size_t len, uint32_t chain)
+    {
+        sqe = get_sqe();
+        io_uring_prep_sync_file_range(sqe, dest_fd, len, offset,
+                                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                      SYNC_FILE_RANGE_WAIT_AFTER);
+        link(sqe, UD_DROP, chain);
+        sqe = get_sqe();
+        io_uring_prep_fadvise(sqe, dest_fd, offset, len, POSIX_FADV_DONTNEED);
+        link(sqe, UD_DROP, chain);
+    };
+
+    size_t chunk = 0;
+    while (chunk < n_chunks)
+    {
+        //! The previous batch of this file, or the last one of the file
+        //! that had the buffers before, still owns them; they can only be
+        //! handed to new reads once it has drained
+        wait_bufs(bufs);
+        int available_sqe = reserve_sqes(chunk_sqes * (n_chunks - chunk) + tail_sqes * n_bufs,
+                                         false, opt);
+        if (unlikely(available_sqe < 0))
+        {
+            return false;
+        }
+
+        size_t room = dev_room(src_dev, dst_dev, opt);
+        if (room == 0)
+        {
+            //! Step aside with what is left. The chunks queued so far have
+            //! completed, flush those still within the window; the window
+            //! starts over when the file goes on.
+            if (drop && chunk > 0)
+            {
+                const size_t first = (chunk > window) ? chunk - window : 0;
+                const uint32_t chain = new_chain(0, src_dev, dst_dev);
+                flush_range(recent[first % recent.size()].start, 0, chain);
+                sqe->flags &= ~(IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS);
+                sqe->user_data |= UD_LAST;
+                ctx.pending_cqe++;
+                int ret = io_uring_submit(ctx.ring);
+                if (unlikely(ret < 0))
+                {
+                    fprintf(stderr, "io_uring_submit: %s\n", strerror(-ret));
+                    return false;
+                }
+            }
+            extents.erase(extents.begin(), extents.begin() + ext_idx);
+            extents[0].start = ext_pos;
+            blocked = true;
+            return true;
+        }
+
+        //! Queue RW requests
+        //! Chunk `c` goes through bufs[c % n_bufs]. Chunks sharing a buffer form
+        //! one link chain (read -> write -> read -> ...), and the chains are
+        //! not linked to each other: the read of chunk k+1 is in flight while
+        //! the write of chunk k drains.
+        size_t batch = n_chunks - chunk;
+        if (drop)
+        {
+            //! every chain started may need its tail flushed
+            const size_t tail = tail_sqes * MIN(n_bufs, batch);
+            batch = MIN(batch, ((size_t)available_sqe - MIN((size_t)available_sqe, tail)) / chunk_sqes);
+        }
+        else
+        {
+            batch = MIN(batch, (size_t)(available_sqe / 2));
+        }
+        batch = MIN(batch, room);
+
+        //! Chunks never straddle extents: the last one of each may be short
+        ranges.clear();
+        while (ranges.size() < batch)
+        {
+            const off_t len = MIN((off_t)buf_size, extents[ext_idx].end - ext_pos);
+            ranges.push_back({ext_pos, ext_pos + len});
+            ext_pos += len;
+            if (ext_pos == extents[ext_idx].end && ++ext_idx < extents.size())
+            {
+                ext_pos = extents[ext_idx].start;
+            }
+        }
+
+        for (size_t slot = 0; slot < MIN(n_bufs, batch); slot++)
+        {
+            int buf_idx = bufs[(chunk + slot) % n_bufs];
+            const unsigned chain_chunks = (batch - slot + n_bufs - 1) / n_bufs;
+            const uint32_t chain = new_chain(chain_chunks, src_dev, dst_dev, buf_idx);
+            size_t last_c = chunk + slot;
+            for (size_t c = chunk + slot; c < chunk + batch; c += n_bufs)
+            {
+                off_t offset = ranges[c - chunk].start;
+                size_t bytes_to_read = ranges[c - chunk].end - offset;
+
+                sqe = get_sqe();
+                prep_read_buf(sqe, src_fd, buf_idx, bytes_to_read, offset);
+                link(sqe, UD_READ, chain);
+                total_n_read += bytes_to_read;
+
+                sqe = get_sqe();
+                prep_write_buf(sqe, dest_fd, buf_idx, bytes_to_read, offset);
+                link(sqe, UD_WRITE, chain);
+
+                if (drop)
+                {
+                    //! start writing the chunk back, the source pages are
+                    //! clean and can go right away
+                    sqe = get_sqe();
+                    io_uring_prep_sync_file_range(sqe, dest_fd, bytes_to_read, offset,
+                                                  SYNC_FILE_RANGE_WRITE);
+                    link(sqe, UD_DROP, chain);
+                    sqe = get_sqe();
+                    io_uring_prep_fadvise(sqe, src_fd, offset, bytes_to_read, POSIX_FADV_DONTNEED);
+                    link(sqe, UD_DROP, chain);
+                    extent& old = recent[c % recent.size()];
+                    if (c >= window)
+                    {
+                        flush_range(old.start, old.end - old.start, chain);
+                    }
+                    old = ranges[c - chunk];
+                }
+                last_c = c;
+            }
+            //! The file's last chunks of this chain are within the window of
+            //! no later chunk: flush from the oldest of them to EOF, along
+            //! with whatever the other chains have written in between
+            if (drop && chunk + batch == n_chunks)
+            {
+                const size_t first = (last_c + n_bufs > window) ? last_c + n_bufs - window
+                                                                : last_c % n_bufs;
+                flush_range(recent[first % recent.size()].start, 0, chain);
+            }
+            //! the last request of a chain posts its cqe, and must not link
+            //! into the next chain. It is the last chunk's write, or a
+            //! page cache request that transfers nothing.
+            sqe->flags &= ~(IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS);
+            sqe->user_data |= UD_LAST;
+            const extent& last = ranges[last_c - chunk];
+            ctx.chains[chain].expected = drop ? 0 : last.end - last.start;
+        }
+
+        //! Update state: one cqe per chain
+        ctx.pending_cqe += MIN(n_bufs, batch);
+        dev_take(src_dev, dst_dev, batch);
+        chunk += batch;
+
+        int ret = io_uring_submit(ctx.ring);
+        if (unlikely(ret < 0))
+        {
+            fprintf(stderr, "io_uring_submit: %s\n", strerror(-ret));
+            return false;
+        }
+    }
+
+    extents.clear();
+    return true;
+}
+
+/**
+ * @brief like sparse_copy, but the blocks of `blk` bytes that read back
+ * as all zeros are not written, leaving holes (--sparse=always)
+ * 
+ * The data has to be looked at between its read and its write, so
+ * instead of read -> write chains, a round of reads (one per buffer) is
+ * waited for, then the runs of blocks with data in each buffer are queued
+ * as writes; those drain before the buffers are read into again.
+ * 
+ * @return true sucessful completion
+ * @return false 
+ */
+bool scan_copy(int src_fd, int dest_fd, int src_dev, int dst_dev,
+               const std::vector<int>& bufs, size_t buf_size,
+               const std::string& src_name, const std::string& dst_name,
+               const std::vector<extent>& extents, off_t& total_n_read,
+               size_t blk, cp_options& opt)
+{
+    total_n_read = 0;
+    const size_t n_bufs = bufs.size();
+    if (n_bufs == 0)
+    {
+        return true;
+    }
+    std::vector<extent> ranges;
+    std::vector<int> res(n_bufs);
+    size_t ext_idx = 0;
+    off_t ext_pos = extents.empty() ? 0 : extents[0].start;
+
+    struct io_uring_sqe* sqe;
+    while (ext_idx < extents.size())
+    {
+        //! the previous round's writes still use the buffers
+        wait_bufs(bufs);
+
+        ranges.clear();
+        while (ranges.size() < n_bufs && ext_idx < extents.size())
+        {
+            const off_t len = MIN((off_t)buf_size, extents[ext_idx].end - ext_pos);
+            sqe = get_meta_sqe(&res[ranges.size()], opt);
+            prep_read_buf(sqe, src_fd, bufs[ranges.size()], len, ext_pos);
+            ranges.push_back({ext_pos, ext_pos + len});
+            ext_pos += len;
+            if (ext_pos == extents[ext_idx].end && ++ext_idx < extents.size())
+            {
+                ext_pos = extents[ext_idx].start;
+            }
+        }
+        if (unlikely(wait_meta() < 0))
+        {
+            return false;
+        }
+
+        bool shrunk = false;
+        for (size_t i = 0; i < ranges.size(); i++)
+        {
+            if (unlikely(res[i] < 0))
+            {
+                fprintf(stderr, "error reading %s: %s\n", src_name.c_str(), strerror(-res[i]));
+                return false;
+            }
+            const char* buf = ctx.buf_mgr.get_buf(bufs[i]);
+            const size_t n_read = res[i];
+            total_n_read += n_read;
+            shrunk |= (n_read < (size_t)(ranges[i].end - ranges[i].start));
+
+            size_t pos = block_run(buf, n_read, blk, true);
+            while (pos < n_read)
+            {
+                const size_t len = block_run(buf + pos, n_read - pos, blk, false);
+                if (unlikely(reserve_sqes(2, false, opt) < 0))
+                {
+                    return false;
+                }
+                sqe = io_uring_get_sqe(ctx.ring);
+                assert(sqe);
+                prep_write_buf(sqe, dest_fd, bufs[i], len, ranges[i].start + pos, pos);
+                //! no chunks: the reads were not taken from the devices' budgets
+                const uint32_t chain = new_chain(0, src_dev, dst_dev, bufs[i]);
+                ctx.chains[chain].expected = len;
+                io_uring_sqe_set_data64(sqe, data_ud(UD_WRITE | UD_LAST, chain));
+                ctx.pending_cqe++;
+                pos += len;
+                pos += block_run(buf + pos, n_read - pos, blk, true);
+            }
+        }
+        int ret_submit = io_uring_submit(ctx.ring);
+        if (unlikely(ret_submit < 0))
+        {
+            fprintf(stderr, "io_uring_submit: %s\n", strerror(-ret_submit));
+            return false;
+        }
+        //! file shrunk while copying
+        if (shrunk) break;
+    }
+
+    return true;
+}
+
+/**
+ * @brief make `dest_fd` share the source's extents instead of copying them
+ * 
+ * Tries FICLONE on the whole file first. If the filesystem rejects that
+ * with EINVAL (e.g. it can only clone whole blocks), the block-aligned
+ * part of the file is cloned chunk by chunk with FICLONERANGE, and the
+ * rest is left to the io_uring data path.
+ * 
+ * @param src_fd 
+ * @param dest_fd 
+ * @param dst_sb 
+ * @param filesize 
+ * @param n_cloned - # of bytes at the start of the file that were cloned
+ * @return true if (part of) the file was cloned
+ * @return false if the filesystem refused to clone it
+ */
+bool reflink_copy(int src_fd, int dest_fd, const struct stat& dst_sb,
+                  const size_t filesize, off_t& n_cloned, cp_options& opt)
+{
+    n_cloned = 0;
+    if (ioctl(dest_fd, FICLONE, src_fd) == 0)
+    {
+        n_cloned = filesize;
+        return true;
+    }
+    if (errno != EINVAL)
+    {
+        return false;
+    }
+
+    const size_t blk_size = MAX((size_t)dst_sb.st_blksize, (size_t)1);
+    const size_t chunk_size = MAX(opt.buf_size / blk_size, (size_t)1) * blk_size;
+    const size_t aligned_size = filesize / blk_size * blk_size;
+    while ((size_t)n_cloned < aligned_size)
+    {
+        struct file_clone_range range;
+        range.src_fd = src_fd;
+        range.src_offset = n_cloned;
+        range.src_length = MIN(chunk_size, aligned_size - n_cloned);
+        range.dest_offset = n_cloned;
+        if (ioctl(dest_fd, FICLONERANGE, &range) != 0)
+        {
+            break;
+        }
+        n_cloned += range.src_length;
+    }
+    return n_cloned > 0;
+}
+
+/**
+ * @brief copy the `extents` of the regular file open on `src_fd` to
+ * `dst_fd` without staging the data in a userspace buffer
+ * 
+ * On the same filesystem this uses copy_file_range, which lets the
+ * filesystem do (or offload) the copy itself. Otherwise the data is
+ * moved src -> pipe -> dst with IORING_OP_SPLICE through a per-file pipe.
+ * Like sparse_copy, what lies between the extents is left alone.
+ * 
+ * @param src_fd 
+ * @param dest_fd 
+ * @param src_sb 
+ * @param dst_sb 
+ * @param src_name 
+ * @param dst_name 
+ * @param extents - in: the parts of the file to copy, out: what is left,
+ *                  for the caller to copy with sparse_copy unless `blocked`
+ * @param pipefd - the file's pipe, {-1, -1} until the first call makes it
+ * @param blocked - set if the devices ran out of budget before all was
+ *                  queued; called again with the extents left, it goes on
+ * @return true sucessful completion, blocked, or nothing could be done
+ * @return false on an error the caller should not fall back from
+ */
+bool zerocopy_copy(int src_fd, int dest_fd,
+                   const struct stat& src_sb, const struct stat& dst_sb,
+                   const std::string& src_name, const std::string& dst_name,
+                   std::vector<extent>& extents, int pipefd[2], bool& blocked,
+                   cp_options& opt)
+{
+    blocked = false;
+    if (src_sb.st_dev == dst_sb.st_dev)
+    {
+        size_t ext_idx = 0;
+        for (; ext_idx < extents.size(); ext_idx++)
+        {
+            extent& ext = extents[ext_idx];
+            off_t src_off = ext.start, dst_off = ext.start;
+            while (src_off < ext.end)
+            {
+                ssize_t n = copy_file_range(src_fd, &src_off, dest_fd, &dst_off,
+                                            ext.end - src_off, 0);
+                if (n < 0)
+                {
+                    if (errno == EINTR) continue;
+                    //! not supported here: let sparse_copy take over from where we are
+                    if (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP ||
+                        errno == EINVAL)
+                    {
+                        ext.start = src_off;
+                        extents.erase(extents.begin(), extents.begin() + ext_idx);
+                        return true;
+                    }
+                    fprintf(stderr, "error copying %s to %s", src_name.c_str(), dst_name.c_str());
+                    return false;
+                }
+                //! file shrunk while copying
+                if (n == 0) break;
+            }
+            if (src_off < ext.end) break;
+        }
+        extents.clear();
+        return true;
+    }
+
+    //! a file that stepped aside goes on through the pipe it had
+    const bool resumed = (pipefd[0] >= 0);
+    if (!resumed)
+    {
+        if (pipe2(pipefd, O_CLOEXEC) != 0)
+        {
+            pipefd[0] = pipefd[1] = -1;
+            return true;
+        }
+        //! closed with the file's descriptors, once the splices have completed
+        ctx.open_fds.push_back(pipefd[0]);
+        ctx.open_fds.push_back(pipefd[1]);
+        //! Each chunk has to fit in the pipe, try to grow it to a whole buffer
+        fcntl(pipefd[1], F_SETPIPE_SZ, opt.buf_size);
+    }
+    const int pipe_size = fcntl(pipefd[1], F_GETPIPE_SZ);
+    if (pipe_size <= 0)
+    {
+        return true;
+    }
+    const size_t chunk_size = MIN(opt.buf_size, (size_t)pipe_size);
+    size_t n_chunks = 0;
+    for (const auto& ext : extents)
+    {
+        n_chunks += (ext.end - ext.start + chunk_size - 1) / chunk_size;
+    }
+    const int src_dev = dev_index(src_sb.st_dev);
+    const int dst_dev = dev_index(dst_sb.st_dev);
+    size_t ext_idx = 0;
+    off_t ext_pos = extents.empty() ? 0 : extents[0].start;
+
+    struct io_uring_sqe* sqe;
+    size_t chunk = 0;
+    while (chunk < n_chunks)
+    {
+        //! The pipe is a FIFO: a new batch can only start once the
+        //! previous one has fully drained through it
+        int available_sqe = reserve_sqes(2 * (n_chunks - chunk), chunk > 0 || resumed, opt);
+        if (unlikely(available_sqe < 0))
+        {
+            return false;
+        }
+        size_t room = dev_room(src_dev, dst_dev, opt);
+        if (room == 0)
+        {
+            //! step aside with what is left, see copy_batch
+            extents.erase(extents.begin(), extents.begin() + ext_idx);
+            extents[0].start = ext_pos;
+            blocked = true;
+            return true;
+        }
+
+        size_t batch = MIN(n_chunks - chunk, (size_t)(available_sqe / 2));
+        batch = MIN(batch, room);
+        const uint32_t chain = new_chain(batch, src_dev, dst_dev);
+        for (size_t c = chunk; c < chunk + batch; c++)
+        {
+            //! Chunks never straddle extents: the last one of each may be short
+            const off_t offset = ext_pos;
+            const size_t bytes_to_splice = MIN((off_t)chunk_size, extents[ext_idx].end - ext_pos);
+            ext_pos += bytes_to_splice;
+            if (ext_pos == extents[ext_idx].end && ++ext_idx < extents.size())
+            {
+                ext_pos = extents[ext_idx].start;
+            }
+
+            sqe = io_uring_get_sqe(ctx.ring);
+            assert(sqe);
+            io_uring_prep_splice(sqe, src_fd, offset, pipefd[1], -1, bytes_to_splice, 0);
+            io_uring_sqe_set_data64(sqe, data_ud(UD_READ, chain));
+            sqe->flags |= IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+
+            sqe = io_uring_get_sqe(ctx.ring);
+            assert(sqe);
+            io_uring_prep_splice(sqe, pipefd[0], -1, dest_fd, offset, bytes_to_splice, 0);
+            if (c + 1 < chunk + batch)
+            {
+                io_uring_sqe_set_data64(sqe, data_ud(UD_WRITE, chain));
+                sqe->flags |= IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+            }
+            else
+            {
+                io_uring_sqe_set_data64(sqe, data_ud(UD_WRITE | UD_LAST, chain));
+                ctx.chains[chain].expected = bytes_to_splice;
+            }
+        }
+
+        //! The whole batch is a single chain
+        ctx.pending_cqe += 1;
+        dev_take(src_dev, dst_dev, batch);
+        chunk += batch;
+
+        int ret = io_uring_submit(ctx.ring);
+        if (unlikely(ret < 0))
+        {
+            fprintf(stderr, "io_uring_submit: %s\n", strerror(-ret));
+            return false;
+        }
+    }
+    extents.clear();
+    return true;
+}
+
+/**
+ * @brief open another descriptor of `fd`'s file with O_DIRECT
+ * 
+ * @return the descriptor, or < 0 if the filesystem doesn't do direct I/O
+ */
+static int reopen_direct(int fd, int flags)
+{
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    return open(path, flags | O_DIRECT | O_CLOEXEC);
+}
+
+//! A regular file of a batch between the steps of its copy. It steps
+//! aside whenever its devices are out of budget, and goes on from here
+//! once the others had their turn (see copy_batch).
+struct reg_job
+{
+    copy_entry* e;
+    //! O_DIRECT descriptors of both ends, -1 if not used
+    int src_direct = -1;
+    int dst_direct = -1;
+    //! -z: the pipe of the splices
+    int pipefd[2] = {-1, -1};
+    //! indices in ctx.devs
+    int src_dev;
+    int dst_dev;
+    //! buffers of ctx.buf_mgr the file's chunks rotate through, taken
+    //! once the file gets to them, given back when it is done
+    std::vector<int> bufs;
+    //! what is left to copy through the O_DIRECT descriptors, and buffered
+    std::vector<extent> direct_extents;
+    std::vector<extent> extents;
+    //! --sparse=always: blocks of zeros of this size are skipped
+    size_t hole_blk = 0;
+    //! -z: the extents go through zerocopy_copy first
+    bool zerocopy = false;
+};
+
+/**
+ * @brief get the copy of a regular file ready, both ends already open:
+ * what can be done at once (reflink) is done, and `job` is left with
+ * what copy_reg_data has to copy
+ * 
+ * @param src_name 
+ * @param dst_name 
+ * @param source_desc 
+ * @param dest_desc 
+ * @param opt 
+ * @param extra_permissions - permissions to add while copying
+ * @param src_open_sb - stat of the open source
+ * @param sb - stat of the open destination
+ * @param job - its `e` already set
+ * @return true sucessful completion
+ * @return false 
+ */
+bool copy_reg(const std::string& src_name, const std::string& dst_name,
+              int source_desc, int dest_desc, cp_options& opt,
+              mode_t extra_permissions,
+              const struct stat& src_open_sb, const struct stat& sb,
+              reg_job& job)
+{
+    off_t n_copied = 0;
+    off_t direct_end = 0;
+    bool sparse;
+    mode_t temporary_mode;
+
+    /* If extra permissions needed for copy_xattr didn't happen (e.g.,
+     due to umask) chmod to add them temporarily; if that fails give
+     up with extra permissions, letting copy_attr fail later.  */
+    temporary_mode = sb.st_mode | extra_permissions;
+    if (temporary_mode != sb.st_mode
+        && (fchmod(dest_desc, temporary_mode) != 0))
+    {
+        extra_permissions = 0;
+    }
+
+    //! advise sequential read
+    posix_fadvise(source_desc, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // buf_size = MIN(SIZE_MAX / 2UL + 1UL, (size_t)MAX(opt.buf_size, sb.st_blksize));
+    // src_blk_size = MIN(SIZE_MAX / 2UL + 1Ul, (size_t)MAX(opt.buf_size, src_open_sb.st_blksize));
+    
+    // /* Compute the least common multiple of the input and output
+    //    buffer sizes, adjusting for outlandish values.  */
+    // blcm_max = SIZE_MAX;
+    // blcm = buffer_lcm(src_blk_size, buf_size, blcm_max);
+
+    // /* Do not bother with a buffer larger than the input file, plus one
+    //    byte to make sure the file has not grown while reading it.  */
+    // if (S_ISREG (src_open_sb.st_mode) && (size_t)src_open_sb.st_size < buf_size)
+    // {
+    //     buf_size = src_open_sb.st_size + 1;
+    // }
+
+    // /* However, stick with a block size that is a positive multiple of
+    //    blcm, overriding the above adjustments.  Watch out for
+    //    overflow.  */
+    // buf_size += blcm - 1;
+    // buf_size -= buf_size % blcm;
+    // if (buf_size == 0 || blcm_max < buf_size)
+    // {
+    //     buf_size = blcm;
+    // }
+    if (opt.reflink != REFLINK_NEVER)
+    {
+        if (!reflink_copy(source_desc, dest_desc, sb, src_open_sb.st_size, n_copied, opt)
+            && opt.reflink == REFLINK_ALWAYS && src_open_sb.st_size > 0)
+        {
+            fprintf(stderr, "failed to clone %s from %s", dst_name.c_str(), src_name.c_str());
+            return false;
+        }
+        if (n_copied == src_open_sb.st_size)
+        {
+            return true;
+        }
+    }
+    job.src_dev = dev_index(src_open_sb.st_dev);
+    job.dst_dev = dev_index(sb.st_dev);
+
+    //! Huge files bypass the page cache. O_DIRECT needs offsets, lengths
+    //! and buffers aligned (the pool's are page aligned), so the aligned
+    //! part goes through O_DIRECT descriptors and only the tail is buffered.
+    if (opt.direct_min && (size_t)src_open_sb.st_size >= opt.direct_min &&
+        n_copied % ctx.page_size == 0 && opt.buf_size >= ctx.page_size)
+    {
+        job.src_direct = reopen_direct(source_desc, O_RDONLY);
+        job.dst_direct = (job.src_direct < 0) ? -1 : reopen_direct(dest_desc, O_WRONLY);
+        if (job.dst_direct >= 0)
+        {
+            ctx.open_fds.push_back(job.src_direct);
+            ctx.open_fds.push_back(job.dst_direct);
+            direct_end = src_open_sb.st_size / ctx.page_size * ctx.page_size;
+        }
+        else if (job.src_direct >= 0)
+        {
+            close(job.src_direct);
+            job.src_direct = -1;
+        }
+    }
+
+    //! Sparse files (fewer blocks than their size takes) only get their data
+    //! copied, and with --sparse=always any file's blocks of zeros are left
+    //! out too. The destination is sized up front, so that the holes, a
+    //! trailing one included, stay holes in it.
+    sparse = (opt.sparse == SPARSE_ALWAYS ||
+              (opt.sparse == SPARSE_AUTO && (off_t)src_open_sb.st_blocks * 512 < src_open_sb.st_size)) &&
+             ftruncate(dest_desc, src_open_sb.st_size) == 0;
+    job.hole_blk = (sparse && opt.sparse == SPARSE_ALWAYS) ? MAX((size_t)sb.st_blksize, (size_t)512) : 0;
+    if (direct_end > n_copied)
+    {
+        //! O_DIRECT can only copy whole pages of the extents
+        if (!sparse || !data_extents(source_desc, n_copied, direct_end, ctx.page_size, job.direct_extents))
+        {
+            job.direct_extents.assign(1, {n_copied, direct_end});
+        }
+    }
+    if (!sparse || !data_extents(source_desc, MAX(n_copied, direct_end), src_open_sb.st_size, 1, job.extents))
+    {
+        job.extents.assign(1, {MAX(n_copied, direct_end), src_open_sb.st_size});
+    }
+
+    //! -z copies the same extents, and leaves sparse_copy what it couldn't
+    job.zerocopy = opt.zerocopy && direct_end == 0;
+    //! TODO: --preserve timestamps, ownerships, xattr, author, acl
+    //! TODO: remove extra permissions
+    return true;
+}
+
+/**
+ * @brief queue what is left of the data of `job`'s file, unless its
+ * devices run out of budget first
+ * 
+ * Both descriptors are closed by close_all_files(), once the requests
+ * using them have completed.
+ * 
+ * @param job 
+ * @param blocked - set if the file stepped aside, with `job` holding
+ *                  what is left; call again later to go on
+ * @return true sucessful completion, or blocked
+ * @return false 
+ */
+bool copy_reg_data(reg_job& job, bool& blocked, cp_options& opt)
+{
+    copy_entry& e = *job.e;
+    off_t n_read;
+    blocked = false;
+
+    if (job.zerocopy)
+    {
+        if (!zerocopy_copy(e.src_fd, e.dst_fd, e.src_sb, e.dst_sb,
+                           e.src_name, e.dst_name, job.extents, job.pipefd, blocked, opt))
+        {
+            return false;
+        }
+        if (blocked)
+        {
+            return true;
+        }
+        job.zerocopy = false;
+    }
+
+    if (job.bufs.empty())
+    {
+        //! No point taking more buffers than the file has chunks
+        size_t n_chunks = 0;
+        for (const auto& ext : job.extents)
+        {
+            n_chunks += (ext.end - ext.start + opt.buf_size - 1) / opt.buf_size;
+        }
+        for (const auto& ext : job.direct_extents)
+        {
+            n_chunks += (ext.end - ext.start + opt.buf_size - 1) / opt.buf_size;
+        }
+        if (n_chunks == 0)
+        {
+            return true;
+        }
+        //! files that stepped aside hold all the buffers, wait for one of
+        //! them to be done
+        const size_t n_bufs = MIN(MIN((size_t)MIN(opt.chunk_bufs, opt.num_bufs), n_chunks),
+                                  ctx.buf_mgr.num_free());
+        if (n_bufs == 0)
+        {
+            blocked = true;
+            return true;
+        }
+        for (size_t i = 0; i < n_bufs; i++)
+        {
+            job.bufs.push_back(ctx.buf_mgr.get_next_buf());
+        }
+    }
+
+    if (!job.direct_extents.empty())
+    {
+        //! whole pages per chunk, and per hole
+        const size_t direct_buf_size = opt.buf_size / ctx.page_size * ctx.page_size;
+        const size_t direct_hole_blk = (job.hole_blk + ctx.page_size - 1) / ctx.page_size * ctx.page_size;
+        if (job.hole_blk)
+        {
+            if (!scan_copy(job.src_direct, job.dst_direct, job.src_dev, job.dst_dev,
+                           job.bufs, direct_buf_size,
+                           e.src_name, e.dst_name, job.direct_extents, n_read, direct_hole_blk, opt))
+            {
+                return false;
+            }
+            job.direct_extents.clear();
+        }
+        else if (!sparse_copy(job.src_direct, job.dst_direct, job.src_dev, job.dst_dev,
+                              job.bufs, direct_buf_size,
+                              e.src_name, e.dst_name, job.direct_extents, n_read, 0, blocked, opt))
+        {
+            return false;
+        }
+        if (blocked)
+        {
+            return true;
+        }
+    }
+    //! the tail reuses the buffers, sparse_copy/scan_copy wait for them
+    if (job.hole_blk)
+    {
+        if (!scan_copy(e.src_fd, e.dst_fd, job.src_dev, job.dst_dev,
+                       job.bufs, opt.buf_size,
+                       e.src_name, e.dst_name, job.extents, n_read, job.hole_blk, opt))
+        {
+            return false;
+        }
+        job.extents.clear();
+        return true;
+    }
+    return sparse_copy(e.src_fd, e.dst_fd, job.src_dev, job.dst_dev,
+                       job.bufs, opt.buf_size,
+                       e.src_name, e.dst_name, job.extents, n_read, opt.drop_window, blocked, opt);
+}
+
+/**
+ * @brief the checks copy() used to do between stat'ing `e` and copying it
+ * 
+ * @param e - entry whose stat requests have completed
+ * @return true if `e` should be copied
+ */
+bool check_entry(copy_entry& e, cp_options& opt)
+{
+    if (e.src_res < 0)
+    {
+        fprintf(stderr, "cannot stat %s", e.src_name.c_str());
+        return false;
+    }
+    statx_to_stat(e.src_stx, e.src_sb);
+
+    if (S_ISDIR(e.src_sb.st_mode) & !opt.recursive)
+    {
+        fprintf(stderr, "-r not specified, omitting directory %s", e.src_name.c_str());
+        return false;
+    }
+    
+    //! TODO: For multifile copy, check if same file appears more than once
+
+    e.new_dst = false;
+    if (!e.nonexistent_dst)
+    {
+        e.new_dst = true;
+    }
+    else if (e.dst_res < 0)
+    {
+        if (e.dst_res != -ENOENT)
+        {
+            fprintf(stderr, "cannot stat %s", e.dst_name.c_str());
+            return false;
+        }
+        e.new_dst = true;
+    }
+    else
+    {
+        statx_to_stat(e.dst_stx, e.dst_sb);
+    }
+
+    if (!e.new_dst) 
+    {
+        //! TODO: Check if src is the same file as dst
+        //! TODO: For --update, compare timestamps
+        //! TODO: For -i or interactive_always_no, check if overwriting is ok or return true
+
+        //! if src is a dir, but destination isn't -- error
+        if (!S_ISDIR(e.dst_sb.st_mode))
+        {
+            if (S_ISDIR(e.src_sb.st_mode))
+            {
+                fprintf(stderr, "cannot overwrite non-directory %s with directory %s", e.dst_name.c_str(), e.src_name.c_str());
+                return false;
+            }
+
+            //! TODO: Handle this case
+            //! rm -rf a b c; mkdir a b c; touch a/f b/f; mv a/f b/f c
+            //! error ("will not overwrite just-created c/f with b/f")
+        }
+
+        //! if destination is a directory, but source isn't
+        if (!S_ISDIR(e.src_sb.st_mode) && S_ISDIR(e.dst_sb.st_mode))
+        {
+            fprintf(stderr, "cannot overwrite directory with non-directory %s", e.dst_name.c_str());
+            return false;
+        }
+
+        //! TODO: Handle backups
+        //! TODO: Handle unlinking destination if needed
+    }
+
+
+    /* TODO: If the ownership might change, or if it is a directory (whose
+     special mode bits may change after the directory is created),
+     omit some permissions at first, so unauthorized users cannot nip
+     in before the file is ready. */
+    e.dst_mode_bits = e.src_sb.st_mode & CHMOD_MODE_BITS;
+    //! TODO: handle preserve_ownership
+    e.omitted_permissions = e.dst_mode_bits & (S_ISDIR(e.src_sb.st_mode) ? S_IWGRP | S_IWOTH : 0);
+
+    //! TODO: For SELinux and -Z, set process security context
+
+    //! TODO: else if (symbolic_link)
+    //! TODO: else if (hard_link)
+    //! TODO: elseif (S_ISFIFO(src_sb.st_mode))
+    //! TODO: block, CHR, socket, S_ISLNK
+    if (!S_ISDIR(e.src_sb.st_mode) && !S_ISREG(e.src_sb.st_mode))
+    {
+        fprintf(stderr, "%s has unknown file type", e.src_name.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief create the destination directories of the batch
+ */
+bool make_dirs(std::vector<copy_entry>& entries, cp_options& opt)
+{
+    struct io_uring_sqe* sqe;
+    bool pending = false;
+    for (auto& e : entries)
+    {
+        if (!e.ok || !S_ISDIR(e.src_sb.st_mode)) continue;
+
+        //! TODO: Check if this directory has already been copied during recursion or otherwise
+        if (e.new_dst || !S_ISDIR(e.dst_sb.st_mode))
+        {
+            mode_t mode = e.dst_mode_bits & ~e.omitted_permissions;
+            sqe = get_meta_sqe(&e.dst_res, opt);
+            io_uring_prep_mkdirat(sqe, e.dst_dirfd, e.dst_relname(), mode);
+            e.made_dir = true;
+            pending = true;
+        }
+        else
+        {
+            e.omitted_permissions = 0;
+        }
+    }
+    if (!pending) return true;
+    if (wait_meta() < 0) return false;
+
+    /* We need search and write permissions to the new directory
+     for writing the directory's contents. Check if these
+     permissions are there.  */
+    for (auto& e : entries)
+    {
+        if (!e.made_dir) continue;
+        if (e.dst_res < 0)
+        {
+            fprintf(stderr, "cannot create directory %s", e.dst_name.c_str());
+            e.ok = false;
+            continue;
+        }
+        sqe = get_meta_sqe(&e.dst_res, opt);
+        io_uring_prep_statx(sqe, e.dst_dirfd, e.dst_relname(), AT_SYMLINK_NOFOLLOW,
+                            STATX_BASIC_STATS, &e.dst_stx);
+    }
+    if (wait_meta() < 0) return false;
+
+    for (auto& e : entries)
+    {
+        if (!e.made_dir || !e.ok) continue;
+        if (e.dst_res < 0)
+        {
+            fprintf(stderr, "cannot stat %s", e.dst_name.c_str());
+            e.ok = false;
+            continue;
+        }
+        statx_to_stat(e.dst_stx, e.dst_sb);
+        if ((e.dst_sb.st_mode & S_IRWXU) != S_IRWXU)
+        {
+            if (fchmodat(e.dst_dirfd, e.dst_relname(), e.dst_sb.st_mode | S_IRWXU, AT_SYMLINK_NOFOLLOW) != 0)
+            {
+                fprintf(stderr, "setting permissions for %s", e.dst_name.c_str());
+                e.ok = false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief open both ends of the regular files of the batch, and check
+ * that the sources were not replaced since they were stat'ed
+ */
+bool open_files(std::vector<copy_entry>& entries, cp_options& opt)
+{
+    struct io_uring_sqe* sqe;
+    size_t n_files = 0;
+    for (auto& e : entries)
+    {
+        n_files += (e.ok && S_ISREG(e.src_sb.st_mode));
+    }
+    if (n_files == 0) return true;
+
+    //! # of open files shouldn't exceed `MAX_OPEN_FILES`
+    if (ctx.open_fds.size() + 4 * n_files > MAX_OPEN_FILES)
+    {
+        handle_cqes(ctx.pending_cqe);
+        close_all_files();
+    }
+
+    for (auto& e : entries)
+    {
+        if (!e.ok || !S_ISREG(e.src_sb.st_mode)) continue;
+        sqe = get_meta_sqe(&e.src_fd, opt);
+        io_uring_prep_openat(sqe, e.src_dirfd, e.src_relname(), O_RDONLY, 0);
+    }
+    if (wait_meta() < 0) return false;
+
+    for (auto& e : entries)
+    {
+        if (!e.ok || !S_ISREG(e.src_sb.st_mode)) continue;
+        if (e.src_fd < 0)
+        {
+            fprintf(stderr, "cannot open %s for reading", e.src_name.c_str());
+            e.ok = false;
+            continue;
+        }
+        ctx.open_fds.push_back(e.src_fd);
+        sqe = get_meta_sqe(&e.src_res, opt);
+        io_uring_prep_statx(sqe, e.src_fd, "", AT_EMPTY_PATH, STATX_BASIC_STATS, &e.src_stx);
+    }
+    if (wait_meta() < 0) return false;
+
+    for (auto& e : entries)
+    {
+        if (!e.ok || !S_ISREG(e.src_sb.st_mode)) continue;
+        if (e.src_res < 0)
+        {
+            fprintf(stderr, "cannot fstat %s", e.src_name.c_str());
+            e.ok = false;
+            continue;
+        }
+
+        /* Compare the source dev/ino from the open file to the incoming,
+         saved ones obtained via a previous call to stat.  */
+        struct stat src_open_sb;
+        statx_to_stat(e.src_stx, src_open_sb);
+        if ((e.src_sb.st_ino != src_open_sb.st_ino) || 
+            (e.src_sb.st_dev != src_open_sb.st_dev))
+        {
+            fprintf(stderr, "skipping file %s, as it was replaced while being copied",
+                    e.src_name.c_str());
+            e.ok = false;
+            continue;
+        }
+        e.src_sb = src_open_sb;
+
+        mode_t dst_mode = e.dst_mode_bits & (S_IRWXU|S_IRWXG|S_IRWXO);
+        int open_flags = O_WRONLY;
+        mode_t open_mode = 0;
+        if (!e.new_dst)
+        {
+            open_flags |= O_TRUNC;
+            e.omitted_permissions = e.extra_permissions = 0;
+        }
+        else
+        {
+            //! TODO: add support for --preserve here
+            open_mode = dst_mode & ~e.omitted_permissions;
+            e.extra_permissions = open_mode & ~dst_mode; /* either 0 or S_IWUSR */
+            open_flags |= O_CREAT | O_EXCL;
+        }
+
+        //! the stat of the destination is linked to its open
+        sqe = get_meta_sqe(&e.dst_fd, opt);
+        io_uring_prep_openat(sqe, e.dst_dirfd, e.dst_relname(), open_flags, open_mode);
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe = get_meta_sqe(&e.dst_res, opt);
+        io_uring_prep_statx(sqe, e.dst_dirfd, e.dst_relname(), 0, STATX_BASIC_STATS, &e.dst_stx);
+    }
+    if (wait_meta() < 0) return false;
+
+    for (auto& e : entries)
+    {
+        if (!e.ok || !S_ISREG(e.src_sb.st_mode)) continue;
+
+        //! TODO: to support -f, unlink file after failed open
+        bool reopened = false;
+        if (!e.new_dst && e.dst_fd == -ENOENT)
+        {
+            //! destination vanished after it was stat'ed; rare enough to do inline
+            mode_t dst_mode = e.dst_mode_bits & (S_IRWXU|S_IRWXG|S_IRWXO);
+            mode_t open_mode = dst_mode & ~e.omitted_permissions;
+            e.extra_permissions = open_mode & ~dst_mode;
+            e.new_dst = true;
+            e.dst_fd = openat(e.dst_dirfd, e.dst_relname(), O_WRONLY | O_CREAT | O_EXCL, open_mode);
+            e.dst_res = (e.dst_fd >= 0 && fstat(e.dst_fd, &e.dst_sb) == 0) ? 0 : -errno;
+            reopened = true;
+        }
+        if (e.dst_fd < 0)
+        {
+            fprintf(stderr, "cannot create regular file %s", e.dst_name.c_str());
+            e.ok = false;
+            continue;
+        }
+        ctx.open_fds.push_back(e.dst_fd);
+        if (e.dst_res < 0)
+        {
+            fprintf(stderr, "cannot fstat %s", e.dst_name.c_str());
+            e.ok = false;
+            continue;
+        }
+        if (!reopened)
+        {
+            statx_to_stat(e.dst_stx, e.dst_sb);
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief order `regs` by where their data starts on the source device,
+ * sweeping up from where the previous batch left off and wrapping around
+ * to the lowest (C-SCAN), so that a rotational disk reads the batch in
+ * mostly one pass
+ */
+static void sort_by_phys(std::vector<copy_entry*>& regs)
+{
+    std::vector<std::pair<uint64_t, copy_entry*>> by_phys;
+    by_phys.reserve(regs.size());
+    for (auto* e : regs)
+    {
+        by_phys.emplace_back(e->ok ? first_phys_offset(e->src_fd) : 0, e);
+    }
+    auto phys_less = [](const std::pair<uint64_t, copy_entry*>& a,
+                        const std::pair<uint64_t, copy_entry*>& b)
+    {
+        return a.first < b.first;
+    };
+    std::stable_sort(by_phys.begin(), by_phys.end(), phys_less);
+    auto head = std::lower_bound(by_phys.begin(), by_phys.end(),
+                                 std::make_pair(ctx.phys_head, (copy_entry*)NULL), phys_less);
+    std::rotate(by_phys.begin(), head, by_phys.end());
+    for (size_t i = 0; i < by_phys.size(); i++)
+    {
+        regs[i] = by_phys[i].second;
+    }
+    if (!by_phys.empty())
+    {
+        ctx.phys_head = by_phys.back().first;
+    }
+}
+
+/**
+ * @brief copy `entries` to their `dst_dirfd` + `dst_relname()`
+ * 
+ * Instead of stat'ing/opening one entry at a time, each step is queued
+ * for the whole batch on the ring and waited on together, so the
+ * metadata requests of many files are in flight at once.
+ * 
+ * @param entries 
+ * @param dirs - directories of the batch are appended here, to be copied
+ *               by copy_dirs
+ * @return bool
+ */
+bool copy_batch(std::vector<copy_entry>& entries, std::deque<dir_job>& dirs,
+                cp_options& opt)
+{
+    struct io_uring_sqe* sqe;
+    bool ok = true;
+
+    //! 1. stat the sources, and the destinations that may exist
+    for (auto& e : entries)
+    {
+        //! TODO: symlinks are NOT followed; change to support -L
+        sqe = get_meta_sqe(&e.src_res, opt);
+        io_uring_prep_statx(sqe, e.src_dirfd, e.src_relname(), AT_SYMLINK_NOFOLLOW,
+                            STATX_BASIC_STATS, &e.src_stx);
+        e.dst_res = -ENOENT;
+        if (e.nonexistent_dst)
+        {
+            sqe = get_meta_sqe(&e.dst_res, opt);
+            io_uring_prep_statx(sqe, e.dst_dirfd, e.dst_relname(), 0,
+                                STATX_BASIC_STATS, &e.dst_stx);
+        }
+    }
+    if (wait_meta() < 0) return false;
+
+    for (auto& e : entries)
+    {
+        e.ok = check_entry(e, opt);
+        ok &= e.ok;
+    }
+
+    //! 2. mkdir the directories, 3. open the regular files
+    if (!make_dirs(entries, opt) || !open_files(entries, opt))
+    {
+        return false;
+    }
+
+    //! 4. queue the data of the regular files
+    std::vector<copy_entry*> regs;
+    for (auto& e : entries)
+    {
+        if (S_ISREG(e.src_sb.st_mode))
+        {
+            regs.push_back(&e);
+        }
+    }
+    if (opt.phys_order)
+    {
+        sort_by_phys(regs);
+    }
+    //! Files whose devices are out of budget step aside and wait at the
+    //! back, so a slow device doesn't hold back those of the others
+    std::deque<reg_job> jobs;
+    for (auto* e : regs)
+    {
+        if (e->ok)
+        {
+            reg_job& job = jobs.emplace_back();
+            job.e = e;
+            e->ok = copy_reg(e->src_name, e->dst_name, e->src_fd, e->dst_fd, opt,
+                             e->extra_permissions, e->src_sb, e->dst_sb, job);
+        }
+        ok &= e->ok;
+    }
+    while (!jobs.empty())
+    {
+        const uint64_t n_chains = ctx.n_chains;
+        for (size_t n = jobs.size(); n > 0; n--)
+        {
+            reg_job job = std::move(jobs.front());
+            jobs.pop_front();
+            bool blocked = false;
+            if (job.e->ok)
+            {
+                job.e->ok = copy_reg_data(job, blocked, opt);
+                ok &= job.e->ok;
+            }
+            if (blocked)
+            {
+                jobs.push_back(std::move(job));
+                continue;
+            }
+            //! the next file to take them waits for what is left in flight
+            for (int buf : job.bufs)
+            {
+                ctx.buf_mgr.free_buf(buf);
+            }
+        }
+        //! every file is waiting for its devices: let some chunks land
+        if (!jobs.empty() && ctx.n_chains == n_chains)
+        {
+            assert(ctx.pending_cqe > 0);
+            handle_cqes(1);
+        }
+    }
+
+    //! 5. queue the directories for copy_dirs
+    for (auto& e : entries)
+    {
+        if (S_ISDIR(e.src_sb.st_mode))
+        {
+            //! TODO: Handle --one_file_system
+            if (e.ok)
+            {
+                auto& d = dirs.emplace_back();
+                d.src_name = std::move(e.src_name);
+                d.dst_name = std::move(e.dst_name);
+                d.dst_rel_off = e.dst_rel_off;
+                d.new_dst = e.new_dst;
+            }
+            ok &= e.ok;
+        }
+    }
+
+    //! TODO: Set acl
+    return ok;
 }
 
-bool copy_reg(const std::string& src_name, const std::string& dst_name,
-              int dst_dirfd, std::string_view dst_relname,
-              cp_options& opt,
-              mode_t dst_mode, mode_t omitted_permissions, bool& new_dst,
-              const struct stat& src_sb)
+/**
+ * @brief set up the calling thread's ring and buffers
+ */
+bool init_ctx(cp_options& opt)
 {
-    char* buf = NULL;
-    off_t n_read;
-    bool return_val = true;
-    int source_desc, dest_desc;
-    mode_t extra_permissions;
-    struct stat sb;
-    struct stat src_open_sb;
-    mode_t temporary_mode;
+    ctx.buf_mgr.init(opt.num_bufs, opt.buf_size);
+    ctx.buf_chains.assign(opt.num_bufs, 0);
+    ctx.open_fds.reserve(MAX_OPEN_FILES);
+    ctx.page_size = getpagesize();
+    ctx.waiter.init(opt.spin_us);
+
+    //! Init io_uring
+    ctx.ring = &ctx.iou;
 
-    size_t buf_size, src_blk_size;
-    size_t blcm_max, blcm;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(io_uring_params));
 
-    //! # of open files shouldn't exceed `MAX_OPEN_FILES-2`
-    if (ctx.open_fds.size() > MAX_OPEN_FILES - 1)
+    if (opt.kernel_poll)
     {
-        handle_cqes(ctx.pending_cqe);
-        close_all_files();
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = opt.ktime;
     }
-    source_desc = open(src_name.c_str(), O_RDONLY);
-    if (source_desc < 0)
+
+    int res = io_uring_queue_init_params(opt.ring_size, ctx.ring, &params);
+    if (res != 0)
     {
-        fprintf(stderr, "cannot open %s for reading", src_name.c_str());
+        fprintf(stderr, "failed to init io_uring queue (%s)\n", strerror(-res));
         return false;
     }
-    if (fstat(source_desc, &src_open_sb) != 0)
-    {
-        fprintf(stderr, "cannot fstat %s", src_name.c_str());
-        return_val = false;
-        goto close_src_desc;
-    }
+    //! stock kernels list directories with getdents64(2) instead
+    ctx.sync_getdents = !io_uring_getdents64_supported(ctx.ring);
 
-    /* Compare the source dev/ino from the open file to the incoming,
-     saved ones obtained via a previous call to stat.  */
-    if ((src_sb.st_ino != src_open_sb.st_ino) || 
-        (src_sb.st_dev != src_open_sb.st_dev))
+    //! Register the buffer pool once, so the kernel doesn't have to
+    //! pin/unpin its pages on every read/write
+    const auto& iovecs = ctx.buf_mgr.get_iovecs();
+    res = io_uring_register_buffers(ctx.ring, iovecs.data(), iovecs.size());
+    if (res != 0)
     {
-        fprintf(stderr, "skipping file %s, as it was replaced while being copied",
-                src_name.c_str());
-        return_val = false;
-        goto close_src_desc;
+        fprintf(stderr, "failed to register buffers, using unregistered buffers (%s)\n", strerror(-res));
     }
+    ctx.fixed_bufs = (res == 0);
 
-    if (!new_dst)
+    if (opt.iowq_workers[0] || opt.iowq_workers[1])
     {
-        int open_flags = O_WRONLY | O_TRUNC;
-        dest_desc = openat(dst_dirfd, dst_relname.data(), open_flags);
-
-        //! TODO: to support -f, unlink file after failed open
-        if (dest_desc < 0 && errno == ENOENT)
+        unsigned values[2] = {opt.iowq_workers[0], opt.iowq_workers[1]};
+        res = io_uring_register_iowq_max_workers(ctx.ring, values);
+        if (res != 0)
         {
-            new_dst = true;
+            fprintf(stderr, "failed to limit io-wq workers (%s)\n", strerror(-res));
         }
     }
-    if (new_dst)
-    {
-        //! TODO: Add copy_file_range here!!!
-        //! TODO: add support for --preserve here
-        mode_t open_mode = dst_mode & ~omitted_permissions;
-        extra_permissions = open_mode & ~dst_mode; /* either 0 or S_IWUSR */
+    return true;
+}
 
-        int open_flags = O_WRONLY | O_CREAT;
-        dest_desc = openat(dst_dirfd, dst_relname.data(), open_flags | O_EXCL, open_mode);
+/**
+ * @brief wait for the calling thread's requests, then tear down its ring
+ * and close its files
+ * 
+ * @return false if any of its data requests failed
+ */
+bool exit_ctx(cp_options& opt)
+{
+    bool ok = true;
 
-    }
-    else
+    //! Handle remaining cqe
+    int err = handle_cqes(ctx.pending_cqe);
+    if (unlikely(err < 0 || ctx.data_errors > 0))
     {
-        omitted_permissions = extra_permissions = 0;
+        ok = false;
     }
 
-    if (dest_desc < 0)
+    if (opt.wait_stats)
     {
-        fprintf(stderr, "cannot create regular file %s", dst_name.c_str());
-        return_val = false;
-        goto close_src_desc;
+        ctx.waiter.report(stderr);
     }
 
-    //! TODO: Add support for --reflink here!!!
-    if (fstat(dest_desc, &sb) != 0)
-    {
-        fprintf(stderr, "cannot fstat %s", dst_name.c_str());
-        return_val = false;
-        goto close_src_and_dst_desc;
-    }
+    //! Exit io_uring
+    io_uring_queue_exit(ctx.ring);
 
-    /* If extra permissions needed for copy_xattr didn't happen (e.g.,
-     due to umask) chmod to add them temporarily; if that fails give
-     up with extra permissions, letting copy_attr fail later.  */
-    temporary_mode = sb.st_mode | extra_permissions;
-    if (temporary_mode != sb.st_mode
-        && (fchmod(dest_desc, temporary_mode) != 0))
+    //! close all files
+    close_all_files();
+    return ok;
+}
+
+/**
+ * @brief copy_dirs on `opt.n_threads` threads, the calling one included.
+ * 
+ * Every thread has its own ring, buffers and open files; the directories
+ * in `dirs`, and everything found in them, are spread through a work_pool.
+ * The chunks a ring has in flight are only counted against its own
+ * budgets, so each thread gets an equal share of `opt.dev_depth`.
+ * 
+ * @param dirs 
+ * @param dst_dirfd 
+ * @return bool
+ */
+bool copy_dirs_parallel(std::deque<dir_job>& dirs, int dst_dirfd, cp_options& opt)
+{
+    work_pool<work_item> pool(opt.n_threads);
+    std::vector<std::thread> threads;
+    //! not vector<bool>, every thread writes its own
+    std::vector<char> oks(opt.n_threads, true);
+    cp_options thread_opt = opt;
+    if (opt.dev_depth)
     {
-        extra_permissions = 0;
+        thread_opt.dev_depth = MAX(1u, opt.dev_depth / opt.n_threads);
     }
 
-    //! TODO: Add support for sparse files here!
-
-    //! advise sequential read
-    posix_fadvise(source_desc, 0, 0, POSIX_FADV_SEQUENTIAL);
-
-    // buf_size = MIN(SIZE_MAX / 2UL + 1UL, (size_t)MAX(opt.buf_size, sb.st_blksize));
-    // src_blk_size = MIN(SIZE_MAX / 2UL + 1Ul, (size_t)MAX(opt.buf_size, src_open_sb.st_blksize));
-    
-    // /* Compute the least common multiple of the input and output
-    //    buffer sizes, adjusting for outlandish values.  */
-    // blcm_max = SIZE_MAX;
-    // blcm = buffer_lcm(src_blk_size, buf_size, blcm_max);
-
-    // /* Do not bother with a buffer larger than the input file, plus one
-    //    byte to make sure the file has not grown while reading it.  */
-    // if (S_ISREG (src_open_sb.st_mode) && (size_t)src_open_sb.st_size < buf_size)
-    // {
-    //     buf_size = src_open_sb.st_size + 1;
-    // }
+    ctx.pool = &pool;
+    ctx.worker_id = 0;
+    share_dirs(dirs);
 
-    // /* However, stick with a block size that is a positive multiple of
-    //    blcm, overriding the above adjustments.  Watch out for
-    //    overflow.  */
-    // buf_size += blcm - 1;
-    // buf_size -= buf_size % blcm;
-    // if (buf_size == 0 || blcm_max < buf_size)
-    // {
-    //     buf_size = blcm;
-    // }
-    buf = ctx.buf_mgr.get_next_buf();
-    if (buf == NULL)
+    for (int i = 1; i < opt.n_threads; i++)
     {
-        handle_cqes(ctx.pending_cqe);
-        ctx.buf_mgr.free_all();
-        buf = ctx.buf_mgr.get_next_buf();
+        threads.emplace_back([&, i]()
+        {
+            if (!init_ctx(thread_opt))
+            {
+                //! nothing was pushed to it, the others do its share and
+                //! the copy can still complete
+                fprintf(stderr, "thread %d could not start, copying with the others\n", i);
+                return;
+            }
+            ctx.pool = &pool;
+            ctx.worker_id = i;
+            std::deque<dir_job> no_dirs;
+            oks[i] = copy_dirs(no_dirs, dst_dirfd, thread_opt);
+            if (!oks[i])
+            {
+                pool.abort();
+            }
+            oks[i] &= exit_ctx(thread_opt);
+        });
     }
-    sparse_copy(source_desc, dest_desc, buf, opt.buf_size,
-                src_name, dst_name, src_open_sb.st_size, n_read, opt);
-    //! TODO: --preserve timestamps, ownerships, xattr, author, acl
-    //! TODO: remove extra permissions
 
+    oks[0] = copy_dirs(dirs, dst_dirfd, thread_opt);
+    if (!oks[0])
+    {
+        pool.abort();
+    }
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+    ctx.pool = NULL;
 
-close_src_and_dst_desc:
-    ctx.open_fds.push_back(dest_desc);
-    // if (close(dest_desc) < 0)
-    // {
-    //     fprintf(stderr, "failed to close %s", dst_name.c_str());
-    //     return_val = false;
-    // }
-close_src_desc:
-    ctx.open_fds.push_back(source_desc);
-    // if (close(source_desc) < 0)
-    // {
-    //     fprintf(stderr, "failed to close %s", src_name.c_str());
-    //     return_val = false;
-    // }
-
-    /**
-     * @note the reason why buf is allocated inside sparse_copy,
-     *       but freed here is so that it can be reused when copying multiple
-     *       blocks
-     */
-    return return_val;
+    bool ok = true;
+    for (char thread_ok : oks)
+    {
+        ok &= (thread_ok != 0);
+    }
+    return ok;
 }
+
 /**
  * @brief copy `src` to `dst_dirfd` + `dst_name` 
  * 
@@ -426,145 +2313,26 @@ bool copy(const std::string& src_name, const std::string& dst_name,
           int dst_dirfd, std::string_view dst_relname, 
           bool nonexistent_dst, cp_options& opt)
 {
-    struct stat src_sb, dst_sb;
-    //! TODO: symlinks are NOT followed; change to support -L
-    if (fstatat(AT_FDCWD, src_name.c_str(), &src_sb, AT_SYMLINK_NOFOLLOW))
-    {
-        fprintf(stderr, "cannot stat %s", src_name.c_str());
-        return false;
-    }
-
-    if (S_ISDIR(src_sb.st_mode) & !opt.recursive)
-    {
-        fprintf(stderr, "-r not specified, omitting directory %s", src_name.c_str());
-        return false;
-    }
-    
-    //! TODO: For multifile copy, check if same file appears more than once
-
-
-
-    bool new_dst = false;
-    if (!nonexistent_dst)
-    {
-        new_dst = true;
-    }
-    else if (fstatat(dst_dirfd, dst_relname.data(), &dst_sb, 0) != 0)
-    {
-        if (errno != ENOENT)
-        {
-            fprintf(stderr, "cannot stat %s", dst_name.c_str());
-            return false;
-        }
-        new_dst = true;
-    }
-
-    if (!new_dst) 
-    {
-        //! TODO: Check if src is the same file as dst
-        //! TODO: For --update, compare timestamps
-        //! TODO: For -i or interactive_always_no, check if overwriting is ok or return true
-
-        //! if src is a dir, but destination isn't -- error
-        if (!S_ISDIR(dst_sb.st_mode))
-        {
-            if (S_ISDIR(src_sb.st_mode))
-            {
-                fprintf(stderr, "cannot overwrite non-directory %s with directory %s", dst_name.c_str(), src_name.c_str());
-                return false;
-            }
-
-            //! TODO: Handle this case
-            //! rm -rf a b c; mkdir a b c; touch a/f b/f; mv a/f b/f c
-            //! error ("will not overwrite just-created c/f with b/f")
-        }
-
-        //! if destination is a directory, but source isn't
-        if (!S_ISDIR(src_sb.st_mode) && S_ISDIR(dst_sb.st_mode))
-        {
-            fprintf(stderr, "cannot overwrite directory with non-directory %s", dst_name.c_str());
-            return false;
-        }
-
-        //! TODO: Handle backups
-        //! TODO: Handle unlinking destination if needed
-    }
-
-
-    /* TODO: If the ownership might change, or if it is a directory (whose
-     special mode bits may change after the directory is created),
-     omit some permissions at first, so unauthorized users cannot nip
-     in before the file is ready. */
-    mode_t dst_mode_bits, omitted_permissions;
-    dst_mode_bits = src_sb.st_mode & CHMOD_MODE_BITS;
-    //! TODO: handle preserve_ownership
-    omitted_permissions = dst_mode_bits & (S_ISDIR(src_sb.st_mode) ? S_IWGRP | S_IWOTH : 0);
-
-    //! TODO: For SELinux and -Z, set process security context
-
-    bool delayed_ok = true;
-    if (S_ISDIR(src_sb.st_mode))
-    {
-        //! TODO: Check if this directory has already been copied during recursion or otherwise
-        bool restore_dst_mode = true;
-        // make new dir
-        if (new_dst || !S_ISDIR(dst_sb.st_mode))
-        {
-            mode_t mode = dst_mode_bits & ~omitted_permissions;
-            if (mkdirat(dst_dirfd, dst_relname.data(), mode) != 0)
-            {
-                fprintf(stderr, "cannot create directory %s", dst_name.c_str());
-                return false;
-            }
-
-            /* We need search and write permissions to the new directory
-             for writing the directory's contents. Check if these
-             permissions are there.  */
-            if (fstatat(dst_dirfd, dst_relname.data(), &dst_sb, AT_SYMLINK_NOFOLLOW) != 0)
-            {
-                fprintf(stderr, "cannot stat %s", dst_name.c_str());
-                return false;
-            }
-            else if ((dst_sb.st_mode & S_IRWXU) != S_IRWXU)
-            {
-                if (fchmodat(dst_dirfd, dst_relname.data(), dst_sb.st_mode | S_IRWXU, AT_SYMLINK_NOFOLLOW) != 0)
-                {
-                    fprintf(stderr, "setting permissions for %s", dst_name.c_str());
-                    return false;
-                }
-            }
-        }
-        else
-        {
-            omitted_permissions = 0;
-        }
-
-        //! TODO: Handle --one_file_system
-        delayed_ok = copy_dir(src_name, dst_name, dst_dirfd, dst_relname, 
-                              new_dst, &src_sb, opt);
-    }
-    //! TODO: else if (symbolic_link)
-    //! TODO: else if (hard_link)
-    else if (S_ISREG(src_sb.st_mode))
+    std::vector<copy_entry> entries(1);
+    auto& e = entries[0];
+    e.src_name = src_name;
+    e.dst_name = dst_name;
+    e.dst_rel_off = dst_name.length() - dst_relname.length();
+    e.dst_dirfd = dst_dirfd;
+    e.dst_at_off = e.dst_rel_off;
+    e.nonexistent_dst = nonexistent_dst;
+
+    std::deque<dir_job> dirs;
+    bool ok = copy_batch(entries, dirs, opt);
+    if (opt.n_threads > 1 && !dirs.empty())
     {
-        if (!copy_reg(src_name, dst_name, dst_dirfd, dst_relname,
-                      opt, dst_mode_bits & (S_IRWXU|S_IRWXG|S_IRWXO),
-                      omitted_permissions, new_dst, src_sb))
-        {
-            return false;
-        }
+        ok &= copy_dirs_parallel(dirs, dst_dirfd, opt);
     }
-    //! TODO: elseif (S_ISFIFO(src_sb.st_mode))
-    //! TODO: block, CHR, socket, S_ISLNK
     else
     {
-        fprintf(stderr, "%s has unknown file type", src_name.c_str());
-        return false;
+        ok &= copy_dirs(dirs, dst_dirfd, opt);
     }
-
-
-    //! TODO: Set acl
-    return delayed_ok;
+    return ok;
 }
 
 
@@ -661,7 +2429,19 @@ int main(int argc, char** argv)
     ("t,ktime", "kernel polling timeout", cxxopts::value<unsigned>()->default_value("60000"))
     ("b,buffersize", "total size of all buffers in KiB", cxxopts::value<size_t>())
     ("n,num_bufs", "number of buffers", cxxopts::value<int>())
+    ("c,chunk_bufs", "number of buffers a single file rotates through", cxxopts::value<int>())
+    ("phys_order", "copy the files of a directory in the order their data sits on disk", cxxopts::value<bool>()->default_value("false"))
+    ("sparse", "create holes in destination files: never|auto|always", cxxopts::value<std::string>())
+    ("reflink", "clone files when the filesystem supports it (auto|always)", cxxopts::value<std::string>()->implicit_value("always"))
+    ("z,zerocopy", "copy with copy_file_range/splice instead of user buffers", cxxopts::value<bool>()->default_value("false"))
     ("q,ringsize", "size of io_uring ring queue", cxxopts::value<size_t>())
+    ("j,threads", "number of threads copying directories, each with its own ring and buffers", cxxopts::value<int>()->default_value("1"))
+    ("d,dev_depth", "max chunks being read from / written to each device, split between the threads; 0 for no limit", cxxopts::value<unsigned>()->default_value("0"))
+    ("iowq_workers", "max io-wq workers per ring: bounded[,unbounded]", cxxopts::value<std::vector<unsigned>>())
+    ("D,direct", "O_DIRECT for files of at least this many MiB", cxxopts::value<size_t>()->implicit_value("1024"))
+    ("drop_behind", "drop copied data from the page cache, keeping at most this many MiB dirty per buffer", cxxopts::value<size_t>()->implicit_value("64"))
+    ("w,spin_us", "µs to poll for completions before sleeping, -1 to never sleep", cxxopts::value<int>())
+    ("wait_stats", "report the time spent spinning and sleeping for completions", cxxopts::value<bool>()->default_value("false"))
     ("h,help", "Print usage");
 
     auto result = options.parse(argc, argv);
@@ -675,11 +2455,75 @@ int main(int argc, char** argv)
     cp_ops.recursive = result["recursive"].as<bool>();
     cp_ops.kernel_poll = result["kpoll"].as<bool>();
     cp_ops.ktime = result["ktime"].as<unsigned>();
+    cp_ops.zerocopy = result["zerocopy"].as<bool>();
+    cp_ops.wait_stats = result["wait_stats"].as<bool>();
+    cp_ops.n_threads = MAX(1, result["threads"].as<int>());
+    cp_ops.dev_depth = result["dev_depth"].as<unsigned>();
+    cp_ops.phys_order = result["phys_order"].as<bool>();
+    if (result.count("direct"))
+    {
+        cp_ops.direct_min = MAX(result["direct"].as<size_t>(), (size_t)1) << 20;
+    }
+    if (result.count("drop_behind"))
+    {
+        //! sync_file_range/fadvise take 32-bit lengths in an sqe
+        cp_ops.drop_window = MIN(MAX(result["drop_behind"].as<size_t>(), (size_t)1), (size_t)1024) << 20;
+    }
+    if (result.count("iowq_workers"))
+    {
+        const auto& workers = result["iowq_workers"].as<std::vector<unsigned>>();
+        for (size_t i = 0; i < MIN(workers.size(), (size_t)2); i++)
+        {
+            cp_ops.iowq_workers[i] = workers[i];
+        }
+    }
 
     if (result.count("num_bufs"))
     {
         cp_ops.num_bufs = result["num_bufs"].as<int>();
     }
+    if (result.count("reflink"))
+    {
+        const auto& when = result["reflink"].as<std::string>();
+        if (when == "auto")
+        {
+            cp_ops.reflink = REFLINK_AUTO;
+        }
+        else if (when == "always")
+        {
+            cp_ops.reflink = REFLINK_ALWAYS;
+        }
+        else
+        {
+            fprintf(stderr, "invalid argument %s for --reflink\n", when.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+    if (result.count("sparse"))
+    {
+        const auto& when = result["sparse"].as<std::string>();
+        if (when == "never")
+        {
+            cp_ops.sparse = SPARSE_NEVER;
+        }
+        else if (when == "auto")
+        {
+            cp_ops.sparse = SPARSE_AUTO;
+        }
+        else if (when == "always")
+        {
+            cp_ops.sparse = SPARSE_ALWAYS;
+        }
+        else
+        {
+            fprintf(stderr, "invalid argument %s for --sparse\n", when.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+    if (result.count("chunk_bufs"))
+    {
+        cp_ops.chunk_bufs = MAX(1, result["chunk_bufs"].as<int>());
+    }
     if (result.count("buffersize"))
     {
         cp_ops.buf_size = result["buffersize"].as<size_t>() * 1024 / cp_ops.num_bufs;
@@ -688,57 +2532,34 @@ int main(int argc, char** argv)
     {
         cp_ops.ring_size = result["ringsize"].as<size_t>();
     }
+    if (cp_ops.drop_window)
+    {
+        //! a chunk's requests plus the flush at the end of each chain
+        cp_ops.ring_size = MAX(cp_ops.ring_size, (size_t)(6 + 2 * cp_ops.chunk_bufs));
+    }
+    if (result.count("spin_us"))
+    {
+        const int spin_us = result["spin_us"].as<int>();
+        cp_ops.spin_us = (spin_us < 0) ? WaitPolicy::SPIN_FOREVER : spin_us;
+    }
     /**
      * Options not supported:
      * 1. -p: preserve perms
      * 2. -i: interactive
      * 3. -L/-l: hardlinks deref
      * 4. -v: verbose
-     * 5. --refline
-     * 6. --sparse
-     * 7. -Z: selinux stuff
+     * 5. -Z: selinux stuff
      * 
      * TODO: Add support for -t?
      * TODO: Add support for -T?
      */
     
     //! Init ctx
-    ctx.buf_mgr.init(cp_ops.num_bufs, cp_ops.buf_size);
-    ctx.open_fds.reserve(MAX_OPEN_FILES);
-    ctx.page_size = getpagesize();
-
-    //! Init io_uring
-    struct io_uring iou;
-    ctx.ring = &iou;
-    
-    struct io_uring_params params;
-    memset(&params, 0, sizeof(io_uring_params));
-
-    if (cp_ops.kernel_poll)
-    {
-        params.flags |= IORING_SETUP_SQPOLL;
-        params.sq_thread_idle = cp_ops.ktime;
-    }
-
-    int res = io_uring_queue_init_params(cp_ops.ring_size, ctx.ring, &params);
-    if (res != 0)
+    if (!init_ctx(cp_ops))
     {
-        fprintf(stderr, "failed to init io_uring queue (%s)\n", strerror(-res));
         return EXIT_FAILURE;
     }
     bool ret = do_copy(result.unmatched(), cp_ops);
-
-    //! Handle remaining cqe
-    int err = handle_cqes(ctx.pending_cqe);
-    if(unlikely(err < 0))
-    {
-        ret = false;
-    }
-
-    //! Exit io_uring
-    io_uring_queue_exit(ctx.ring);
-
-    //! close all files
-    close_all_files();
+    ret &= exit_ctx(cp_ops);
     return ret ? EXIT_SUCCESS : EXIT_FAILURE;
 }
\ No newline at end of file
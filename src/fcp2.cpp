@@ -2,29 +2,34 @@
 #include <cassert>
 #include <vector>
 #include <map>
+#include <algorithm>
 #include <queue>
 #include <array>
-#include <queue>
+#include <deque>
 #include <unordered_set>
 #include <unordered_map>
 #include <cstring>
 #include <filesystem>
+#include <thread>
 
 #include "fcp2.h"
+#include "wait-policy.h"
+#include "work-pool.h"
+#include "fiemap.h"
+#include "cxxopts.hpp"
 
 #include <linux/stat.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <unistd.h>
 #include <memory>
 
 using namespace std;
 
 // TODO: P0: File copying done only partially
-// TODO: P0: Call getdents till we see all entries -- done only partially till now.
 // TODO: P0: Make use of fixed buffers.
 // TODO: P0: Use stat to get the file size, use that to pipeline bufsize of reads/writes.
 // TODO: P0: Pipeline the open/create/read/write 
-// TODO: P1: This won't scale, we need to schedule considering sq, cq sizes, fixed files, fixed buffers.
 // TODO: P1: Check if we want to fstat to get the file size before copying. Alternative is to read until EOF in a pipelined fashion
 // TODO: P2: Fix asserts;
 
@@ -34,8 +39,6 @@ using namespace std;
 // TODO: Fix memory leaks
 
 
-// TODO P2: Vectors are better
-unordered_set<string> dirjobs;
 // TODO P2: Should find a way without this
 unordered_set<string> submitted_readdirs;
 
@@ -45,36 +48,146 @@ unordered_set<string> submitted_readdirs;
 
 
 // Data structures
-struct io_uring ring;
-
-unordered_set<std::shared_ptr<CopyJob>> cp_jobs;
+// Each worker thread has its own ring, and everything tied to it: fixed
+// file slots, metas, credits, and the directories and jobs it works on.
+thread_local struct io_uring ring;
+
+// Copy jobs are only ever in one of these queues, or owned by the metas of
+// their in-flight requests; a cqe moves a job to the queue of its new state.
+// COPY_STAT_PENDING: stat to be submitted
+thread_local deque<std::shared_ptr<CopyJob>> stat_pending_q;
+// COPY_STAT_DONE/COPY_CP_IN_PROGRESS: ready to submit its next chunk
+thread_local deque<std::shared_ptr<CopyJob>> copy_ready_q;
+// COPY_CP_DONE: slots to be released
+thread_local deque<std::shared_ptr<CopyJob>> copy_done_q;
 vector<io_uring_cqe*> pending_cqes;
-unordered_set<string> created_dest_dirs;
-RegFDAllocator<REG_FD_SIZE> fd_alloc;
-unordered_map<string, std::vector<uint8_t>> dirent_buf_map;
+// Destination directories, indexed by node id
+thread_local deque<DirNode> dir_nodes;
+// # of DirNode src_fd/dst_fd's open or being opened
+thread_local int dir_fds_open = 0;
+thread_local RegFDAllocator<REG_FD_SIZE> fd_alloc;
+thread_local DirentBufPool<DIRENT_BUF_POOL_SIZE> dirent_bufs;
+thread_local MetaSlab metas;
+// Directories waiting for a dirent buffer and a slot
+thread_local deque<int> pending_readdirs;
+thread_local NameArena names;
+
+thread_local Credits credits;
+thread_local WaitPolicy waiter;
+bool wait_stats = false;
+// --phys_order: ready jobs by where their data starts on the source device,
+// handed out in one elevator sweep per round
+bool phys_order = false;
+thread_local multimap<uint64_t, std::shared_ptr<CopyJob>> phys_q;
+thread_local uint64_t phys_head = 0;
+
+// Options every worker sets its ring up with
+bool kernel_alloc = false;
+int spin_us = DEFAULT_SPIN_US;
+// Shared by the workers, -j
+work_pool<SharedDir> *pool = NULL;
+// Jobs that failed to copy, for the exit status
+std::atomic<int> n_failed_jobs{0};
+thread_local int worker_id = 0;
+
+// `num` is the number of cqes the queued requests will post
+void submit_jobs(int num) {
+    // cout << "submitting " << num << " jobs" << endl;
+    credits.take_cqes(num);
+    io_uring_submit(&ring);
+}
+
+// Make room for `n` sqes, waiting for the SQ poll thread if needed. Called
+// before queueing a chain, which mustn't be split across submissions; after
+// it, io_uring_get_sqe can't fail for the chain's sqes.
+void reserve_sqes(unsigned n) {
+    while(io_uring_sq_space_left(&ring) < n) {
+        io_uring_submit(&ring);
+        io_uring_sqring_wait(&ring);
+    }
+}
 
-int in_progress_jobs = 0;
-//! FIXME: This is buggy, setting this to a large enough number for now.
-int max_in_prog = 100000;
+void set_meta(struct io_uring_sqe *sqe, const RequestMeta *meta) {
+    io_uring_sqe_set_data64(sqe, make_user_data(meta->type, meta->idx));
+}
 
-static inline void io_uring_prep_getdents64(struct io_uring_sqe *sqe, int fd,
-					    void *buf, unsigned int count)
-{
-	io_uring_prep_rw(IORING_OP_GETDENTS64, sqe, fd, buf, count, 0);
+// For a meta shared by several ops, each completing as its own type
+void set_meta(struct io_uring_sqe *sqe, const RequestMeta *meta, int type) {
+    io_uring_sqe_set_data64(sqe, make_user_data(type, meta->idx));
 }
 
-void submit_jobs(int num) {
-    // cout << "submitting " << num << " jobs" << endl;
-    in_progress_jobs += num;
-    io_uring_submit(&ring);
+// For ops with IOSQE_CQE_SKIP_SUCCESS, which only complete on failure
+void set_no_meta(struct io_uring_sqe *sqe, int type) {
+    io_uring_sqe_set_data64(sqe, make_user_data(type, NO_META));
+}
+
+// Drop a reference to the directory; once nothing in it needs its fds they
+// are closed, and its own reference on the parent is dropped
+void put_dir_node(int dir_node) {
+    while(dir_node != -1) {
+        DirNode& dir = dir_nodes[dir_node];
+        if(--dir.refs > 0)
+            return;
+        if(dir.src_fd >= 0) {
+            close(dir.src_fd);
+            dir_fds_open--;
+        }
+        if(dir.dst_fd >= 0) {
+            close(dir.dst_fd);
+            dir_fds_open--;
+        }
+        dir.src_fd = dir.dst_fd = -1;
+        dir_node = dir.parent;
+    }
+}
+
+// Append the path of the directory to `out`
+void build_dir_path(std::string& out, int dir_node, bool dst) {
+    const DirNode& dir = dir_nodes[dir_node];
+    if(dir.parent != 0) {
+        build_dir_path(out, dir.parent, dst);
+        out += '/';
+    }
+    out += names.get(dst ? dir.dst_name : dir.src_name);
 }
 
-int prep_mkdir(const filesystem::path& dst_path) {
+// Name of the directory relative to its parent's fd `dirfd`; without one,
+// its full path, built in `scratch`
+const char* dir_at_name(int dirfd, int dir_node, bool dst, std::string& scratch) {
+    const DirNode& dir = dir_nodes[dir_node];
+    if(dirfd != AT_FDCWD)
+        return names.get(dst ? dir.dst_name : dir.src_name);
+    scratch.clear();
+    build_dir_path(scratch, dir_node, dst);
+    return scratch.c_str();
+}
+
+// Same for a file of `job`, relative to the fd of the job's directory
+const char* file_at_name(int dirfd, CopyJob& job, bool dst, std::string& scratch) {
+    if(dirfd != AT_FDCWD)
+        return names.get(job.get_name());
+    scratch.clear();
+    build_dir_path(scratch, job.get_dst_dir_node(), dst);
+    scratch += '/';
+    scratch += names.get(job.get_name());
+    return scratch.c_str();
+}
+
+std::string job_path(CopyJob& job, bool dst) {
+    std::string path;
+    file_at_name(AT_FDCWD, job, dst, path);
+    return path;
+}
+
+int prep_mkdir(int dir_node) {
     struct io_uring_sqe *sqe;
-    //! FIXME: Allocating memory for every mkdir can't be good; do something better
-    RequestMeta *meta = new RequestMeta(FCP_OP_MKDIR);
-    meta->dirpath = dst_path;
+    RequestMeta *meta = metas.alloc(FCP_OP_MKDIR);
+    meta->dir_node = dir_node;
+    int dirfd = dir_nodes[dir_nodes[dir_node].parent].dst_fd;
+    if(dirfd < 0)
+        dirfd = AT_FDCWD;
 
+    reserve_sqes(2);
     // Get mkdir sqe
     sqe = io_uring_get_sqe(&ring);
     assert(sqe != NULL);
@@ -82,219 +195,382 @@ int prep_mkdir(const filesystem::path& dst_path) {
     // Prepare mkdir request
     // TODO: Fix perms
     // cout << "Creating directory at " << dst_path.c_str() << endl;
-    
-    // TODO: Fix memory leak. 
-    string *create_dirname = new string(dst_path);
 
-    cout << "Creating dir " << *create_dirname << endl;
+    // The path lives in the meta until the cqe
+    const char *name = dir_at_name(dirfd, dir_node, true, meta->path);
+    cout << "Creating dir " << name << endl;
 
-    // path dst_pth = path(dst_path);
-    io_uring_prep_mkdirat(sqe, -1, create_dirname->c_str(), 0777);
-    io_uring_sqe_set_data(sqe, (void *)meta);
+    io_uring_prep_mkdirat(sqe, dirfd, name, 0777);
+    if(dir_fds_open >= MAX_DIR_FDS) {
+        // Out of fds: its children will be created by full path
+        set_meta(sqe, meta);
+        return 1;
+    }
+
+    // Open the new directory for its children, they are released by this cqe
+    dir_fds_open++;
+    sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+    set_meta(sqe, meta, FCP_OP_MKDIR);
+
+    sqe = io_uring_get_sqe(&ring);
+    assert(sqe != NULL);
+    io_uring_prep_openat(sqe, dirfd, name, O_PATH | O_DIRECTORY, 0);
+    set_meta(sqe, meta, FCP_OP_OPENDSTDIR);
+
+    return 1;
+}
+
+// Queue the next getdents on the directory opened at meta->reg_fd,
+// continuing from meta->dir_off. Return number of requests queued
+int prep_getdents(RequestMeta *meta) {
+    struct io_uring_sqe *sqe;
+
+    reserve_sqes(1);
+    sqe = io_uring_get_sqe(&ring);
+    assert(sqe != NULL);
+
+    io_uring_prep_getdents64(sqe, meta->reg_fd, dirent_bufs.get_buf(meta->dirent_buf),
+                             DIR_BUF_SIZE, meta->dir_off);
+    set_meta(sqe, meta);
+    sqe->flags = IOSQE_FIXED_FILE;
 
     return 1;
 }
 
 // Return number of requests queued
-int prep_readdir(const filesystem::path& dirpath, std::vector<uint8_t>& dirbuf, const filesystem::path& dst_path) {
+int prep_readdir(int dir_node, int dirent_buf) {
     struct io_uring_sqe *sqe;
+    int num = 0;
+    int dirfd = dir_nodes[dir_nodes[dir_node].parent].src_fd;
+    if(dirfd < 0)
+        dirfd = AT_FDCWD;
 
-    //! FIXME: mem alloc for every dir read can't be good :(
-    RequestMeta *meta = new RequestMeta(FCP_OP_GETDENTS);
+    // Allocated once per directory, and reused by all its getdents
+    RequestMeta *meta = metas.alloc(FCP_OP_GETDENTS);
     // Store the regfd that was used for the open.
     meta->reg_fd = fd_alloc.get_free();
+    assert(meta->reg_fd != -1);
+    meta->dirent_buf = dirent_buf;
 
     // Get sqe
+    reserve_sqes(3);
     sqe = io_uring_get_sqe(&ring);
     assert(sqe != NULL);
 
-    //! FIXME: Fix memory leak / mem alloc for every dirpath can't be good
-    string *sqe_dirname = new string(dirpath.string());
+    meta->dir_node = dir_node;
 
-    cout << "Doing getdents for " << *sqe_dirname << endl;
+    const char *name = dir_at_name(dirfd, dir_node, false, meta->path);
+    cout << "Doing getdents for " << name << endl;
+
+    if(dir_fds_open < MAX_DIR_FDS) {
+        // O_PATH fd to stat/open the entries by name. Queued ahead of the
+        // getdents, so the name is consumed before its meta can be released.
+        RequestMeta *open_meta = metas.alloc(FCP_OP_OPENSRCDIR);
+        open_meta->dir_node = dir_node;
+        dir_fds_open++;
+        io_uring_prep_openat(sqe, dirfd, name, O_PATH | O_DIRECTORY, 0);
+        set_meta(sqe, open_meta);
+        num++;
+
+        sqe = io_uring_get_sqe(&ring);
+        assert(sqe != NULL);
+    }
 
-    // Prepare open request
-    // TODO: We don't want to open it again for subsequent writes.
-    io_uring_prep_openat_direct(sqe, 0, sqe_dirname->c_str(), O_RDONLY, 0, meta->reg_fd);
+    // Prepare open request; the directory stays open until getdents hits EOF
+    if(fd_alloc.is_kernel_alloc()) {
+        // getdents needs the slot, so it is queued from the open's cqe
+        io_uring_prep_openat_direct(sqe, dirfd, name, O_RDONLY, 0, IORING_FILE_INDEX_ALLOC);
+        set_meta(sqe, meta, FCP_OP_OPENDIR);
+        return num + 1;
+    }
+    io_uring_prep_openat_direct(sqe, dirfd, name, O_RDONLY, 0, meta->reg_fd);
     // This operation won't return a cqe (IOSQE_CQE_SKIP_SUCCESS)
     sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
-
-    // Get sqe for getdents
-    sqe = io_uring_get_sqe(&ring);
-    assert(sqe != NULL);
+    set_no_meta(sqe, FCP_OP_OPENDIR);
 
     // Prepare getdents request
-    // TODO: Do this in loop.
-    io_uring_prep_getdents64(sqe, meta->reg_fd, &dirbuf[0], DIR_BUF_SIZE);
+    prep_getdents(meta);
 
-    //! FIXME: Copying strings/path is never good, use a hash/id of the entire job, and keep a job set
-    meta->dirpath = dirpath;
-    meta->dest_dirpath = dst_path;
-    io_uring_sqe_set_data(sqe, (void *)meta);
-    sqe->flags = IOSQE_FIXED_FILE;
-    // sqe->file_index = meta->reg_fd + 1;
+    return num + 1;
+}
 
-    return 1;
+// Start reading pending directories, as far as dirent buffers, fixed file
+// slots and credits allow. Return number of requests queued
+int start_readdirs() {
+    int num = 0;
+    // Opens of the source directory and the first getdents
+    while(!pending_readdirs.empty() && fd_alloc.num_free() > 0 && credits.admit(3, 2, 0)) {
+        int dirent_buf = dirent_bufs.get_free();
+        if(dirent_buf == -1)
+            break;
+        num += prep_readdir(pending_readdirs.front(), dirent_buf);
+        pending_readdirs.pop_front();
+    }
+    return num;
 }
 
-void process_dir(const filesystem::path& src_path, const filesystem::path& dst) {
-    struct io_uring_cqe *cqe;
+// `parent_node` is the DirNode of the directory it is in
+void process_dir(uint32_t src_name, uint32_t dst_name, int parent_node) {
     int num_wait = 0;
-    int ret;
 
-    // filesystem::path dst(dst_path);
+    int dir_node = dir_nodes.size();
+    dir_nodes.emplace_back(src_name, dst_name, false, parent_node);
+    dir_nodes[parent_node].refs++;
 
-    // bool need_submission = false;
-    
-    if(created_dest_dirs.find(dst.parent_path().string()) != created_dest_dirs.end() && in_progress_jobs < max_in_prog) {
+    if(dir_nodes[parent_node].created) {
         // Prepare mkdir request
-        num_wait += prep_mkdir(dst);
-        // need_submission = true;
+        num_wait += prep_mkdir(dir_node);
     } else {
-        //! FIXME: Way too much string passing, use id/hash
-        dirjobs.insert(dst.string());
+        dir_nodes[parent_node].waiting_mkdirs.push_back(dir_node);
     }
 
-    dirent_buf_map[src_path.string()].resize(DIR_BUF_SIZE);
-
-    // if(submitted_readdirs.find(src_path) == submitted_readdirs.end()) {
-        // Prepare readdir request
-        num_wait += prep_readdir(src_path, dirent_buf_map[src_path.string()], dst);
-        // need_submission = true;
-    // }
+    // Prepare readdir request, or wait for a buffer and a slot
+    pending_readdirs.push_back(dir_node);
+    num_wait += start_readdirs();
 
     submit_jobs(num_wait);
 }
 
 
 void process_dir_jobs() {
-    if(in_progress_jobs > max_in_prog) 
-        return;
-    vector<string> to_erase;
-    for(const auto& dir: dirjobs) {
-        filesystem::path dst(dir);
-
-        if(created_dest_dirs.find(dst.parent_path()) != created_dest_dirs.end()) {
-            // If parent directory has been created, then create the directory
-            int ret = prep_mkdir(dst);
-            submit_jobs(ret);
-            to_erase.push_back(dir);
-        } else {
-            // cout << "Could not find parent directory for " << dst.string() << endl;   
-        }
-    }
+    submit_jobs(start_readdirs());
+}
 
-    for(const auto& elem: to_erase) {
-        dirjobs.erase(elem);
-    }
+// Close the fixed file slot of a directory that hit EOF; the slot goes back
+// to the allocator with the cqe. Return number of requests queued
+int prep_closedir(RequestMeta *meta) {
+    struct io_uring_sqe *sqe;
+
+    reserve_sqes(1);
+    sqe = io_uring_get_sqe(&ring);
+    assert(sqe != NULL);
+
+    io_uring_prep_close_direct(sqe, meta->reg_fd);
+    set_meta(sqe, meta, FCP_OP_CLOSEDIR);
+
+    return 1;
 }
 
-// Unused: closing fixed files not supported?
-int prep_close(int reg_fd, int type) {
+// Close both slots of a copy job; they go back to the allocator with the cqe
+// of the src close, which is linked after the dst close. `meta` is that of
+// the write the closes are linked to, if any, whose completion then comes
+// with the close's cqe. Return number of requests queued
+int prep_close_files(const std::shared_ptr<CopyJob>& job, RequestMeta *meta) {
     struct io_uring_sqe *sqe;
-    RequestMeta *meta = new RequestMeta(type);
-    
-    meta->reg_fd = reg_fd;
 
+    assert(job->get_dst_fd() != job->get_src_fd());
+
+    reserve_sqes(2);
     sqe = io_uring_get_sqe(&ring);
     assert(sqe != NULL);
+    io_uring_prep_close_direct(sqe, job->get_dst_fd());
+    sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+    set_no_meta(sqe, FCP_OP_CLOSEFILE);
 
-    io_uring_prep_close(sqe, reg_fd);
-    sqe->flags = IOSQE_FIXED_FILE;
-    // __io_uring_set_target_fixed_file(sqe, reg_fd);
-    io_uring_sqe_set_data(sqe, (void *)meta);
+    sqe = io_uring_get_sqe(&ring);
+    assert(sqe != NULL);
+    io_uring_prep_close_direct(sqe, job->get_src_fd());
+    if(meta == NULL) {
+        meta = metas.alloc(FCP_OP_CLOSEFILE);
+        meta->cp_job = job;
+    }
+    set_meta(sqe, meta, FCP_OP_CLOSEFILE);
 
+    job->set_close_submitted();
     return 1;
 }
 
-void process_getdents(const io_uring_cqe *cqe) {
+void process_getdents(const io_uring_cqe *cqe, RequestMeta *meta) {
     // Read the direntry list and then add to the cpjobs
     // copyjob* job = new copyjob(src, dst, dst_dir_path)
     assert(cqe->res >= 0);
 
     uint8_t *bufp;
 	uint8_t *end;
-    RequestMeta *meta = (RequestMeta *)cqe->user_data;
-    filesystem::path src_path, dst_path, dst_dir;
 
-    bufp = (uint8_t *)&dirent_buf_map[meta->dirpath][0];
+    bufp = dirent_bufs.get_buf(meta->dirent_buf);
     end = bufp + cqe->res;
 
+    // Jobs are made in inode number order, not hash order, so their statx
+    // walk the inode table (ext4, XFS) instead of seeking around it
+    static thread_local vector<struct linux_dirent64*> dents;
+    dents.clear();
     while (bufp < end) {
-		struct linux_dirent64 *dent;
+        struct linux_dirent64 *dent = (struct linux_dirent64 *)bufp;
+        dents.push_back(dent);
+        bufp += dent->d_reclen;
+        // The next read goes on after the last entry in directory order
+        meta->dir_off = dent->d_off;
+    }
+    sort(dents.begin(), dents.end(), [](const linux_dirent64 *a, const linux_dirent64 *b) {
+        return a->d_ino < b->d_ino;
+    });
 
-		dent = (struct linux_dirent64 *)bufp;
+    for (struct linux_dirent64 *dent: dents) {
 		if (strcmp(dent->d_name, ".") && strcmp(dent->d_name, "..")) {
 			// Create copy jobs;
-            src_path = meta->dirpath / dent->d_name;
-            dst_path = meta->dest_dirpath / dent->d_name;
             if(dent->d_type == DT_REG) {
                 //// cout << "dirent: " << dent->d_name << endl;
                 // Sets the state to FSTAT_PENDING
-                cp_jobs.insert(std::make_shared<CopyJob>(src_path, dst_path));
+                stat_pending_q.push_back(std::make_shared<CopyJob>(names.add(dent->d_name), meta->dir_node));
+                dir_nodes[meta->dir_node].refs++;
             } 
             else if (dent->d_type == DT_DIR) {
-                process_dir(src_path, dst_path);
+                uint32_t name = names.add(dent->d_name);
+                process_dir(name, name, meta->dir_node);
             }
 		}
-		bufp += dent->d_reclen;
 	}
 
-    dirent_buf_map.erase(meta->dirpath);
     assert(meta->reg_fd != -1);
 
-    // int num = prep_close(meta->reg_fd, FCP_OP_CLOSEDIR);
-    // submit_jobs(num);
+    if(cqe->res > 0) {
+        // The entries were consumed above, so the buffer is free for the
+        // next read of the same directory
+        submit_jobs(prep_getdents(meta));
+        return;
+    }
 
-    fd_alloc.release(meta->reg_fd);
+    // EOF; the meta is released with the close's cqe
+    dirent_bufs.release(meta->dirent_buf);
+    put_dir_node(meta->dir_node);
+    submit_jobs(prep_closedir(meta));
+
+    submit_jobs(start_readdirs());
+}
+
+// A job whose destination directory exists can start copying
+void push_ready(std::shared_ptr<CopyJob> job) {
+    if(phys_order)
+        phys_q.emplace(job->get_phys(), std::move(job));
+    else
+        copy_ready_q.push_back(std::move(job));
+}
+
+// The job is stat'ed (and located), it can copy once its directory exists
+void stat_job_done(const std::shared_ptr<CopyJob>& job) {
+    DirNode& dir = dir_nodes[job->get_dst_dir_node()];
+    if(dir.created)
+        push_ready(job);
+    else
+        dir.waiting_jobs.push_back(job);
 }
 
-void process_stat_copy_job(const io_uring_cqe *cqe) {
-    RequestMeta *meta = (RequestMeta *) cqe->user_data;
-    meta->cp_job->set_size(meta->statbuf->stx_size);
+void process_stat_copy_job(const io_uring_cqe *cqe, RequestMeta *meta) {
+    meta->cp_job->set_size(meta->statbuf.stx_size);
     // cout << "Setting the state to COPY_STAT_DONE for file " << meta->cp_job->get_dst_path() << endl;
     meta->cp_job->set_state(COPY_STAT_DONE);
+    // With --phys_order the open linked to the stat goes on from here
+    if(!phys_order)
+        stat_job_done(meta->cp_job);
+}
+
+// --phys_order: FIEMAP needs a descriptor of its own, as the copy only gets
+// fixed file slots; the ring opened one after the stat
+void process_phys_open(const io_uring_cqe *cqe, RequestMeta *meta) {
+    if(cqe->res >= 0) {
+        meta->cp_job->set_phys(first_phys_offset(cqe->res));
+        close(cqe->res);
+    }
+    stat_job_done(meta->cp_job);
 }
 
-void process_write_completion(const std::shared_ptr<CopyJob>& job, int bytes_written, RequestMeta *meta) {
-    assert(meta->copy_req_bytes == bytes_written);
-    job->add_bytes_copied(bytes_written);
+// Once both opens have completed, the job can submit the rest of its chunks
+void process_open_completion(const std::shared_ptr<CopyJob>& job) {
+    if(job->is_src_opened() && job->is_dst_opened() && !job->is_failed() &&
+       job->get_bytes_copy_submitted() < job->get_size())
+        copy_ready_q.push_back(job);
+}
+
+// Release what was waiting for the directory to be created
+void process_mkdir_completion(int dir_node) {
+    DirNode& dir = dir_nodes[dir_node];
+    int num = 0;
+
+    dir.created = true;
+    for(int child: dir.waiting_mkdirs)
+        num += prep_mkdir(child);
+    for(auto& job: dir.waiting_jobs)
+        push_ready(std::move(job));
+    // Nothing waits on it anymore
+    vector<int>().swap(dir.waiting_mkdirs);
+    vector<std::shared_ptr<CopyJob>>().swap(dir.waiting_jobs);
+
+    submit_jobs(num);
+}
 
-    if(job->get_size() - job->get_bytes_copied() == 0) {
+// The chunk of `meta` is done with, copied or failed. The job is done once
+// all of the file is, or after a failure, all the chunks it had submitted.
+void process_write_completion(const std::shared_ptr<CopyJob>& job, RequestMeta *meta) {
+    free(meta->buf);
+    credits.put_buf(meta->copy_req_bytes);
+    job->add_bytes_copied(meta->copy_req_bytes);
+
+    // Opens that skipped their cqe are done once a write linked to them is
+    if(!job->is_src_opened() || !job->is_dst_opened()) {
+        job->set_src_opened();
+        job->set_dst_opened();
+        process_open_completion(job);
+    }
+
+    ssize_t end = job->is_failed() ? job->get_bytes_copy_submitted() : job->get_size();
+    if(job->get_bytes_copied() == end) {
         job->set_state(COPY_CP_DONE);
-        assert(job->get_buf() != NULL);
-        fprintf(stderr, "Freeing the address %p for the file %s\n", job->get_buf(), job->get_dst_path().c_str());
-        job->free_buf();
+        copy_done_q.push_back(job);
     }
 }
 
-void process_closedir(const struct io_uring_cqe *cqe) {
-    RequestMeta *meta = (RequestMeta *)cqe->user_data;
-    fd_alloc.release(meta->reg_fd);
+// A read or write of the chunk of `meta` failed or came up short. Either
+// breaks its link chain, and the rest is cancelled without a cqe: the write
+// after a read, and the closes of a single-chunk file, which are submitted
+// again once the job is done. This cqe takes the place of the one that was
+// credited for the chunk.
+void fail_chunk(const io_uring_cqe *cqe, RequestMeta *meta, bool dst) {
+    std::shared_ptr<CopyJob> job = meta->cp_job;
+    cerr << (dst ? "Write to " : "Read from ") << job_path(*job, dst) << " failed: "
+         << (cqe->res < 0 ? strerror(-cqe->res) : "short transfer") << endl;
+    if(!job->is_failed()) {
+        job->set_failed();
+        n_failed_jobs++;
+    }
+    // The job isn't done, so its closes were linked to this chunk
+    if(job->is_close_submitted())
+        job->clear_close_submitted();
+    process_write_completion(job, meta);
 }
 
-void process_closefile(const struct io_uring_cqe *cqe) {
-    RequestMeta *meta = (RequestMeta *)cqe->user_data;
+void process_closedir(const struct io_uring_cqe *cqe, RequestMeta *meta) {
     fd_alloc.release(meta->reg_fd);
+    // A directory may be waiting for the slot
+    submit_jobs(start_readdirs());
+}
+
+void process_closefile(const struct io_uring_cqe *cqe, RequestMeta *meta) {
+    fd_alloc.release(meta->cp_job->get_dst_fd());
+    fd_alloc.release(meta->cp_job->get_src_fd());
 }
 
 /**
  * Process the current cqe //and re-process the rest 
  */
 int process_cqe(const io_uring_cqe *cqe) {
-    RequestMeta *meta;
-    meta = (RequestMeta *)cqe->user_data;
+    uint64_t user_data = io_uring_cqe_get_data64(cqe);
+    int type = user_data_type(user_data);
+    uint32_t idx = user_data_idx(user_data);
+    RequestMeta *meta = (idx == NO_META) ? NULL : metas.get(idx);
 
     // TODO: P1: Handle other types
-    switch(meta->type)
+    switch(type)
     {
         case FCP_OP_MKDIR: {
             // cout << "GOT CQE! Processing a mkdir operation" << endl;
             if(cqe->res < 0) {
-                cerr << "Mkdir at " << meta->dirpath << " operation failed: " << strerror(-cqe->res) << endl;
+                std::string path;
+                build_dir_path(path, meta->dir_node, true);
+                cerr << "Mkdir at " << path << " operation failed: " << strerror(-cqe->res) << endl;
                 exit(1);
             }
-            created_dest_dirs.insert(meta->dirpath);
+            process_mkdir_completion(meta->dir_node);
             break;
         }
         case FCP_OP_GETDENTS: {
@@ -303,32 +579,55 @@ int process_cqe(const io_uring_cqe *cqe) {
                 cerr << "Getdents operation failed: " << strerror(-cqe->res) << endl;
                 exit(1);
             }
-            process_getdents(cqe);
+            process_getdents(cqe, meta);
+            // The meta is reused by the next getdents, or released at EOF
+            return 0;
+        }
+        case FCP_OP_OPENSRCDIR: {
+            DirNode& dir = dir_nodes[meta->dir_node];
+            if(cqe->res < 0 || dir.refs == 0) {
+                // Its entries are opened by full path, or it is already done
+                if(cqe->res >= 0)
+                    close(cqe->res);
+                dir_fds_open--;
+                break;
+            }
+            dir.src_fd = cqe->res;
             break;
         }
-        case FCP_OP_OPENDIR: {
-            // TODO: 
-            cerr << "FCP_OP_OPENDIR not handled" << endl;
-            exit(1);
+        case FCP_OP_OPENDSTDIR: {
+            // Linked to the mkdir, whose failure has been handled already
+            if(cqe->res >= 0)
+                dir_nodes[meta->dir_node].dst_fd = cqe->res;
+            else
+                dir_fds_open--;
+            process_mkdir_completion(meta->dir_node);
             break;
         }
-        case FCP_OP_READ: {
-             if(cqe->res < 0) {
-                cerr << "GOT CQE! A read operation failed: " << strerror(-cqe->res) << endl;
+        case FCP_OP_OPENDIR: {
+            // Without kernel_alloc only posted on failure, and the linked
+            // getdents is cancelled
+            if(cqe->res < 0) {
+                cerr << "Opendir operation failed: " << strerror(-cqe->res) << endl;
                 exit(1);
-            } else {
-                // cout << "GOT CQE! A read operation completed: " << cqe->res << endl;
             }
-            // return 1;
+            meta->reg_fd = cqe->res;
+            submit_jobs(prep_getdents(meta));
+            // The meta is kept for the getdents
+            return 0;
+        }
+        case FCP_OP_READ: {
+            // Skips its cqe on success, a full read; it shares the meta of
+            // the write it is linked to
+            fail_chunk(cqe, meta, false);
             break;
         }
         case FCP_OP_WRITE: {
-            if(cqe->res < 0) {
-                cerr << "GOT CQE! A write operation failed: " << strerror(-cqe->res) << endl;
-                exit(1);
+            if(cqe->res != meta->copy_req_bytes) {
+                fail_chunk(cqe, meta, true);
             } else {
                 // cout << "GOT CQE! A write operation completed: " << cqe->res << endl;
-                process_write_completion(meta->cp_job, cqe->res, meta);
+                process_write_completion(meta->cp_job, meta);
             }
             break;
         }
@@ -337,8 +636,10 @@ int process_cqe(const io_uring_cqe *cqe) {
                 cerr << "A create file operation for copy job failed: " << strerror(-cqe->res) << endl;
                 exit(1);
             } else {
-                RequestMeta *meta = (RequestMeta *)cqe->user_data;
-                meta->cp_job->set_src_opened();
+                if(fd_alloc.is_kernel_alloc())
+                    meta->cp_job->set_dst_fd(cqe->res);
+                meta->cp_job->set_dst_opened();
+                process_open_completion(meta->cp_job);
                 // cout << "GOT CQE! A create file operation for file " << meta->cp_job->get_dst_path() << " for copyjob has completed: " << cqe->res << endl;
             }
             break;
@@ -349,55 +650,84 @@ int process_cqe(const io_uring_cqe *cqe) {
                 exit(1);
             } else {
                 // cout << "GOT CQE! A stat operation for copy job completed: " << cqe->res << endl;
-                process_stat_copy_job(cqe);
+                process_stat_copy_job(cqe, meta);
             }
             break;
         }
+        case FCP_OP_OPENPHYS: {
+            // Only costs the job its place in the order if it failed
+            process_phys_open(cqe, meta);
+            break;
+        }
         case FCP_OP_OPENFILE: {
             if(cqe->res < 0) {
                 cerr << "An openfile operation for copy job failed: " << strerror(-cqe->res) << endl;
                 exit(1);
             } else {
-                RequestMeta *meta = (RequestMeta *)cqe->user_data;
-                meta->cp_job->set_dst_opened();
+                if(fd_alloc.is_kernel_alloc())
+                    meta->cp_job->set_src_fd(cqe->res);
+                meta->cp_job->set_src_opened();
+                process_open_completion(meta->cp_job);
                 // cout << "GOT CQE! An openfile operation for copyjob of file " << meta->cp_job->get_dst_path() << " has completed: " << cqe->res  << endl;
             }
             break;
         }
         case FCP_OP_CLOSEDIR: {
-            // closing fixed files not supported
-            assert(0);
             if(cqe->res < 0) {
                 cerr << "A closedir operation failed for fd " << meta->reg_fd << " : " << strerror(-cqe->res) << endl;
                 exit(1);
             } else {
-                process_closedir(cqe);
+                process_closedir(cqe, meta);
             }
             break;
         }
         case FCP_OP_CLOSEFILE: {
-            // closing fixed files not supported
-            assert(0);
             if(cqe->res < 0) {
                 cerr << "A close file operation failed: " << strerror(-cqe->res) << endl;
                 exit(1);
             } else {
-                process_closefile(cqe);
+                // Linked after the only write of the file, which didn't post
+                if(meta->buf != NULL)
+                    process_write_completion(meta->cp_job, meta);
+                process_closefile(cqe, meta);
             }
             break;
         }
         default: assert(false);
     }
 
+    if(meta != NULL)
+        metas.release(meta);
     return 0;
 }
 
+// Opens linked to the first read only matter on failure, as the first
+// write's cqe tells they are done; they skip their cqe, unless the kernel
+// picks the slot or the name lives in meta->path, which must outlive the sqe.
+// Return number of cqes the open posts
+int set_open_meta(struct io_uring_sqe *sqe, RequestMeta *meta, int dirfd) {
+    if(fd_alloc.is_kernel_alloc() || dirfd == AT_FDCWD) {
+        set_meta(sqe, meta);
+        return 1;
+    }
+    sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+    set_no_meta(sqe, meta->type);
+    metas.release(meta);
+    return 0;
+}
+
+// Return number of cqes the opens post
 int _prep_copy_opens(std::shared_ptr<CopyJob> job) {
     struct io_uring_sqe *sqe;
     RequestMeta *meta;
+    int num = 0;
 
     int dst_reg_fd = fd_alloc.get_free();
     int src_reg_fd = fd_alloc.get_free();
+    reserve_sqes(2);
+    const DirNode& dir = dir_nodes[job->get_dst_dir_node()];
+    int src_dirfd = dir.src_fd < 0 ? AT_FDCWD : dir.src_fd;
+    int dst_dirfd = dir.dst_fd < 0 ? AT_FDCWD : dir.dst_fd;
 
     // ***** BEGIN: Open src dir *****
     //
@@ -405,12 +735,15 @@ int _prep_copy_opens(std::shared_ptr<CopyJob> job) {
     assert(sqe != NULL);
 
     // TODO: Add fadvise if needed
-    io_uring_prep_openat_direct(sqe, -1, job->get_src_path().c_str(), O_RDONLY, 0, src_reg_fd);
-    sqe->flags = IOSQE_IO_LINK;
-    // sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
-    meta = new RequestMeta(FCP_OP_OPENFILE);
+    meta = metas.alloc(FCP_OP_OPENFILE);
     meta->cp_job = job;
-    io_uring_sqe_set_data(sqe, (void *)meta);
+    io_uring_prep_openat_direct(sqe, src_dirfd, file_at_name(src_dirfd, *job, false, meta->path), O_RDONLY, 0,
+                                src_reg_fd == FD_KERNEL_ALLOC ? IORING_FILE_INDEX_ALLOC : src_reg_fd);
+    // The first read is linked to the opens, unless it has to wait for the
+    // slots the kernel picks
+    if(src_reg_fd != FD_KERNEL_ALLOC)
+        sqe->flags = IOSQE_IO_LINK;
+    num += set_open_meta(sqe, meta, src_dirfd);
 
     // ***** END: Open src dir *****
 
@@ -419,18 +752,20 @@ int _prep_copy_opens(std::shared_ptr<CopyJob> job) {
     assert(sqe != NULL);
 
     // TODO: Fix permissions
-    io_uring_prep_openat_direct(sqe, -1, job->get_dst_path().c_str(), O_CREAT | O_WRONLY, 0777, dst_reg_fd);
-    sqe->flags = IOSQE_IO_LINK;
-    // sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
-    meta = new RequestMeta(FCP_OP_CREATFILE);
+    meta = metas.alloc(FCP_OP_CREATFILE);
     meta->cp_job = job;
-    io_uring_sqe_set_data(sqe, (void *) meta);
+    io_uring_prep_openat_direct(sqe, dst_dirfd, file_at_name(dst_dirfd, *job, true, meta->path), O_CREAT | O_WRONLY, 0777,
+                                dst_reg_fd == FD_KERNEL_ALLOC ? IORING_FILE_INDEX_ALLOC : dst_reg_fd);
+    if(dst_reg_fd != FD_KERNEL_ALLOC)
+        sqe->flags = IOSQE_IO_LINK;
+    num += set_open_meta(sqe, meta, dst_dirfd);
     // ***** END: Open/Create dst dir *****
 
     job->set_src_fd(src_reg_fd);
     job->set_dst_fd(dst_reg_fd);
+    job->set_open_submitted();
 
-    return 2;
+    return num;
 }
 
 // TODO: This can be further asynchronized/pipelined.
@@ -462,17 +797,22 @@ bool do_file_copy(std::shared_ptr<CopyJob> job) {
     if(job->get_size() == 0)
         return false;
 
-    // TODO: Fix memory leak.
-    // TODO: Use registered buffers.
-    assert(bytes_to_copy > 0);
-    char *buf = (char *)calloc(bytes_to_copy, 1);
-
     // Submission chain.
-    // open(src) -> open(dst) -> read(src) -> write(src) or read(src) -> write(src)
+    // open(src) -> open(dst) -> read(src) -> write(src) [-> close(dst) -> close(src)]
+    // or read(src) -> write(src)
+    reserve_sqes(job->is_open_submitted() ? 2 : 6);
 
-    if(job->get_bytes_copy_submitted() == 0) {
+    if(!job->is_open_submitted()) {
         // This means that this is the first write operation so we need to do open as well.
+        // Out of slots: wait for other copies to finish
+        if(fd_alloc.num_free() < 2)
+            return false;
         num_jobs += _prep_copy_opens(job);
+        if(fd_alloc.is_kernel_alloc()) {
+            // Read once the open cqes have told us the slots
+            submit_jobs(num_jobs);
+            return true;
+        }
     } else {
         // If the file creation/openings have not completed, then do nothing.
         if(!job->is_dst_opened() || !job->is_src_opened()) {
@@ -481,8 +821,19 @@ bool do_file_copy(std::shared_ptr<CopyJob> job) {
         }
     }
 
+    // TODO: Use registered buffers.
+    assert(bytes_to_copy > 0);
+    char *buf = (char *)calloc(bytes_to_copy, 1);
+    credits.take_buf(bytes_to_copy);
+
     // cout << "bytes_to_copy = " << bytes_to_copy << " for file " << job->get_dst_path() << endl;
 
+    // Shared by the read and the write: whichever of them fails frees it
+    meta = metas.alloc(FCP_OP_WRITE);
+    meta->copy_req_bytes = bytes_to_copy;
+    meta->cp_job = job;
+    meta->buf = buf;
+
     // ***** BEGIN: Read src file *****
     sqe = io_uring_get_sqe(&ring);
     assert(sqe != NULL);
@@ -490,11 +841,11 @@ bool do_file_copy(std::shared_ptr<CopyJob> job) {
     // cout << "src_reg_fd = " << job->get_src_fd() << endl;
     io_uring_prep_read(sqe, job->get_src_fd(), buf, bytes_to_copy, job->get_bytes_copy_submitted());
     sqe->flags = IOSQE_FIXED_FILE;
-    // hardlink won't fail for partial reads.
+    // A soft link: a short read breaks it too, and then posts its cqe like
+    // a failed one, while the write is cancelled
     sqe->flags |= IOSQE_IO_LINK;
     sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
-    meta = new RequestMeta(FCP_OP_READ);
-    io_uring_sqe_set_data(sqe, (void *)meta);
+    set_meta(sqe, meta, FCP_OP_READ);
     // ***** END: Read src file *****
     
     // ***** BEGIN: Write dst file *****
@@ -502,20 +853,26 @@ bool do_file_copy(std::shared_ptr<CopyJob> job) {
     assert(sqe != NULL);
 
     // TODO: Use file size for deterministic copy size.
-    // TODO: Skip success CQE unless it is the last write
+    // Posts its cqe, which frees the buffer and accounts the bytes; only a
+    // single-chunk file's write skips it, its close's cqe does both instead.
+    // Chunks of bigger files still post one cqe each.
     // cout << "dst_reg_fd = " << job->get_dst_fd() << endl;
     io_uring_prep_write(sqe, job->get_dst_fd(), buf, bytes_to_copy, job->get_bytes_copy_submitted());
     sqe->flags = IOSQE_FIXED_FILE;
-    meta = new RequestMeta(FCP_OP_WRITE);
-    meta->copy_req_bytes = bytes_to_copy;
-    meta->cp_job = job;
-    job->set_buf(buf);
     // cout << "WRITE ISSUE: " << job->get_dst_path() << " " << meta->cp_job << " = " << job  << endl;
-    io_uring_sqe_set_data(sqe, (void *)meta);
+    set_meta(sqe, meta);
     // ***** END: Write dst file *****
-    num_jobs += 1;
 
-    // TODO: We assume success, fix for robustness
+    // The whole file in one chunk: nothing else uses its slots, close them
+    // right after the write. The file then posts a single cqe, the close's.
+    if(job->get_bytes_copy_submitted() == 0 && bytes_to_copy == job->get_size()) {
+        sqe->flags |= IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+        num_jobs += prep_close_files(job, meta);
+    } else {
+        num_jobs += 1;
+    }
+
+    // A failed or short chunk is settled by fail_chunk
     job->add_bytes_copy_submitted(bytes_to_copy);
 
     submit_jobs(num_jobs);
@@ -525,166 +882,314 @@ bool do_file_copy(std::shared_ptr<CopyJob> job) {
 void do_copy_fstat(std::shared_ptr<CopyJob> job) {
     struct io_uring_sqe *sqe;
 
-    // TODO: Fix memory leaks
-    RequestMeta *meta = new RequestMeta(FCP_OP_STAT_COPY_JOB);
+    RequestMeta *meta = metas.alloc(FCP_OP_STAT_COPY_JOB);
     meta->cp_job = job;
-    meta->statbuf = std::make_unique<struct statx>();
 
     // This means that stat is not done yet.
+    reserve_sqes(2);
     sqe = io_uring_get_sqe(&ring);
     assert(sqe != NULL);
 
-    io_uring_prep_statx(sqe, -1, job->get_src_path().c_str(), 0, STATX_SIZE, meta->statbuf.get());
-    io_uring_sqe_set_data(sqe, meta);
+    int dirfd = dir_nodes[job->get_dst_dir_node()].src_fd;
+    if(dirfd < 0)
+        dirfd = AT_FDCWD;
+    const char *name = file_at_name(dirfd, *job, false, meta->path);
+    io_uring_prep_statx(sqe, dirfd, name, 0, STATX_SIZE, &meta->statbuf);
+    set_meta(sqe, meta);
+
+    // --phys_order: open a plain fd for FIEMAP right after, posting after
+    // the stat's cqe
+    if(phys_order) {
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe = io_uring_get_sqe(&ring);
+        assert(sqe != NULL);
+        RequestMeta *open_meta = metas.alloc(FCP_OP_OPENPHYS);
+        open_meta->cp_job = job;
+        io_uring_prep_openat(sqe, dirfd, file_at_name(dirfd, *job, false, open_meta->path),
+                             O_RDONLY | O_CLOEXEC, 0);
+        set_meta(sqe, open_meta);
+    }
 
-    cout << "Submitting fstat for " << job->get_src_path() << endl;
-    submit_jobs(1);
+    cout << "Submitting fstat for " << name << endl;
+    submit_jobs(phys_order ? 2 : 1);
 
     job->set_state(COPY_STAT_SUBMITTED);
     // cout << "Submitted stat operation for " << job->get_dst_path() << endl;
 }
 
 void do_copy_close(std::shared_ptr<CopyJob> job) {
-    int num_jobs = 0;
-
-    assert(job->get_dst_fd() != job->get_src_fd());
-    num_jobs += prep_close(job->get_dst_fd(), FCP_OP_CLOSEFILE);
-    num_jobs += prep_close(job->get_src_fd(), FCP_OP_CLOSEFILE);
+    submit_jobs(prep_close_files(job, NULL));
+}
 
-    submit_jobs(num_jobs);
+// Whether the next chunk of the job, with its opens and closes when it is
+// the first, fits in the fixed file slots and the credits
+bool admit_chunk(CopyJob& job) {
+    size_t bytes = std::min<ssize_t>(MAX_RW_BUF_SIZE, job.get_size() - job.get_bytes_copy_submitted());
+    if(job.is_open_submitted())
+        return credits.admit(2, 1, bytes);
+    return fd_alloc.num_free() >= 2 && credits.admit(6, 4, bytes);
 }
 
 bool process_copy_jobs() {
-    // cout << "Processing copy_jobs: " << cp_jobs.size() << endl;
-
     bool submitted = false;
 
-    vector<std::shared_ptr<CopyJob>> to_delete;
+    // Close the slots of finished jobs, unless linked after their write;
+    // others may be waiting for them
+    while(!copy_done_q.empty()) {
+        std::shared_ptr<CopyJob>& job = copy_done_q.front();
+        if(!job->is_close_submitted())
+            do_copy_close(job);
+        put_dir_node(job->get_dst_dir_node());
+        copy_done_q.pop_front();
+    }
 
-    for(const auto& job: cp_jobs) {
-        if(created_dest_dirs.find(job->get_dst_dir()) == created_dest_dirs.end()) {
-            // parent dir not present so skip.
-            break;
-        }
+    // Stats don't depend on the destination, submit them right away
+    while(!stat_pending_q.empty() && credits.admit(phys_order ? 2 : 1, phys_order ? 2 : 1, 0)) {
+        do_copy_fstat(stat_pending_q.front());
+        stat_pending_q.pop_front();
+        submitted = true;
+    }
 
-        switch(job->get_state()) {
-        case COPY_STAT_PENDING:
-            // cout << "Processing job in STAT_PENDING state "<< endl;
-            if(in_progress_jobs > max_in_prog)
-                break;
-            do_copy_fstat(job);
-            submitted = true;
-            break;
-        case COPY_STAT_SUBMITTED:
-            break;
-        case COPY_STAT_DONE:
-        case COPY_CP_IN_PROGRESS:
-            // cout << "Processing job in STAT_DONE/CP_IN_PROGRESS " << endl;
-            if(in_progress_jobs > max_in_prog)
-                break;
-            if(do_file_copy(job))
-                submitted = true;
-            break;
-        case COPY_CP_DONE:
-            // cout << "Processing job in CP_DONE state "<< endl;
-            to_delete.push_back(job);
-            fd_alloc.release(job->get_dst_fd());
-            fd_alloc.release(job->get_src_fd());
-            break;
-        default:
-            // cout << "Copy Job in invalid state " << job->get_state() << " Crashing" << endl;
-            exit(1);
+    // New jobs join in the order of their data on disk: sweeping up from
+    // where the last sweep ended, then wrapping around to the lowest (C-SCAN)
+    if(!phys_q.empty()) {
+        auto head = phys_q.lower_bound(phys_head);
+        phys_head = (head != phys_q.begin()) ? prev(head)->first : phys_q.rbegin()->first;
+        for(auto it = head; it != phys_q.end(); ++it)
+            copy_ready_q.push_back(std::move(it->second));
+        for(auto it = phys_q.begin(); it != head; ++it)
+            copy_ready_q.push_back(std::move(it->second));
+        phys_q.clear();
+    }
+
+    // Every job that is ready gets one chunk per round; jobs that have
+    // more to copy go to the back of the queue.
+    size_t n_ready = copy_ready_q.size();
+    while(n_ready-- > 0) {
+        std::shared_ptr<CopyJob> job = copy_ready_q.front();
+
+        if(job->get_size() == 0) {
+            // TODO: Create empty files
+            put_dir_node(job->get_dst_dir_node());
+            copy_ready_q.pop_front();
+            continue;
         }
-        if(to_delete.size() > 0)
+        // Done with its chunks in flight, through copy_done_q
+        if(job->is_failed()) {
+            copy_ready_q.pop_front();
+            continue;
+        }
+        // Out of fixed file slots or credits, retried after the next cqes
+        if(!admit_chunk(*job))
             break;
-    }
 
-    //! FIXME: Bad pattern; erase in place using iterators
-    for(const auto& job: to_delete) {
-        cp_jobs.erase(job);
+        copy_ready_q.pop_front();
+        if(do_file_copy(job))
+            submitted = true;
+        job->set_state(COPY_CP_IN_PROGRESS);
+        // Otherwise requeued by the open cqes, or done with its last write
+        if(job->is_src_opened() && job->is_dst_opened() && !job->is_failed() &&
+           job->get_bytes_copy_submitted() < job->get_size())
+            copy_ready_q.push_back(std::move(job));
     }
+
     return submitted;
 }
 
-int main() {
+// Hand work this worker can't start yet to an idle one: a directory waiting
+// for a dirent buffer, and files waiting for credits to be stat'ed. Only
+// those whose destination directory exists go, so the other worker needn't
+// wait for a mkdir of ours.
+void share_work() {
+    for(auto it = pending_readdirs.rbegin(); it != pending_readdirs.rend(); ++it) {
+        int dir_node = *it;
+        if(!dir_nodes[dir_node].created)
+            continue;
+        SharedDir work;
+        build_dir_path(work.src_path, dir_node, false);
+        build_dir_path(work.dst_path, dir_node, true);
+        work.list = true;
+        pool->push(worker_id, std::move(work));
+        pending_readdirs.erase(std::next(it).base());
+        // Dropping the listing's reference closes its fds
+        put_dir_node(dir_node);
+        break;
+    }
+
+    // The newest files of one directory
+    if(stat_pending_q.empty())
+        return;
+    int dir_node = stat_pending_q.back()->get_dst_dir_node();
+    if(!dir_nodes[dir_node].created)
+        return;
+    SharedDir work;
+    build_dir_path(work.src_path, dir_node, false);
+    build_dir_path(work.dst_path, dir_node, true);
+    work.list = false;
+    while(!stat_pending_q.empty() && work.files.size() < SHARE_FILES &&
+          stat_pending_q.back()->get_dst_dir_node() == dir_node) {
+        work.files.emplace_back(names.get(stat_pending_q.back()->get_name()));
+        stat_pending_q.pop_back();
+        put_dir_node(dir_node);
+    }
+    pool->push(worker_id, std::move(work));
+}
+
+// Take on work shared by another worker, under a DirNode of its own whose
+// full paths hang off node 0
+void adopt_dir(SharedDir& work) {
+    int dir_node = dir_nodes.size();
+    dir_nodes.emplace_back(names.add(work.src_path.c_str()), names.add(work.dst_path.c_str()), true, 0);
+    dir_nodes[0].refs++;
+
+    for(auto& file: work.files) {
+        stat_pending_q.push_back(std::make_shared<CopyJob>(names.add(file.c_str()), dir_node));
+        dir_nodes[dir_node].refs++;
+    }
+    if(work.list) {
+        pending_readdirs.push_back(dir_node);
+    } else {
+        // Nothing is listed, only its files hold it
+        put_dir_node(dir_node);
+    }
+
+    process_copy_jobs();
+    process_dir_jobs();
+}
+
+// Set up the ring of the calling worker
+void init_worker() {
     int ret;
-    int files[REG_FD_SIZE];
-    struct io_uring_cqe *cqe;
     struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
     params.sq_thread_idle = 60 * 1000;
-    params.flags = IORING_SETUP_SQPOLL;
+    // CLAMP: on kernels with a lower limit, take the largest CQ they allow
+    // rather than failing; credits are sized by what we get
+    params.flags = IORING_SETUP_SQPOLL | IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    params.cq_entries = CQ_SIZE;
 
-    // cp_jobs = new unordered_set<CopyJob*>();
-    // pending_cqes = new vector<io_uring_cqe*>();
-    // created_dest_dirs = new unordered_set<string>();
-    // dirent_buf_map = new unordered_map<string, uint8_t*>();
-
-    // ret = io_uring_queue_init(RINGSIZE, &ring, 0);
     ret = io_uring_queue_init_params(RINGSIZE, &ring, &params);
     if (ret != 0)
     {
         cerr << "Failed to init io_uring queue " << strerror(-ret) << endl;
-        return 1;
+        exit(1);
+    }
+    // The kernel may round the CQ size up, or clamp it down
+    credits.init(&ring, params.cq_entries);
+    // Directories are only listed through the ring
+    if(!io_uring_getdents64_supported(&ring)) {
+        cerr << "The kernel has no io_uring getdents64" << endl;
+        exit(1);
     }
 
-    ret = io_uring_register_files(&ring, fd_alloc.fd_list.data(), fd_alloc.get_size());
+    fd_alloc.set_kernel_alloc(kernel_alloc);
+    if(fd_alloc.is_kernel_alloc())
+        ret = io_uring_register_files_sparse(&ring, fd_alloc.get_size());
+    else
+        ret = io_uring_register_files(&ring, fd_alloc.fd_list.data(), fd_alloc.get_size());
     if(ret != 0) {
         cerr << "Failed to register files: " << strerror(-ret) << endl;
-        return 1;
+        exit(1);
     }
+    waiter.init(spin_us < 0 ? WaitPolicy::SPIN_FOREVER : spin_us);
 
-    const filesystem::path src_dir("/home/ubuntu/project/aos_project/src_dir");
-    const filesystem::path dst_dir("/home/ubuntu/project/aos_project/dst_dir");
-
-    created_dest_dirs.insert("/home/ubuntu/project/aos_project");
-    process_dir(src_dir, dst_dir);
-
-    struct __kernel_timespec ts;
-    ts.tv_nsec = 0;
-    ts.tv_sec = 1;
+    // Node 0 stands for the parent of the destination, which must exist
+    dir_nodes.emplace_back(names.add(""), names.add(""), true, -1);
+}
 
-    // for debugging
-    // int count = 0;
+// Process cqes until the pool has nothing left. Worker 0 starts with the
+// copy of `src_dir`; the others with what it shares.
+void run_worker(int id, const filesystem::path& src_dir, const filesystem::path& dst_dir) {
+    int ret;
+    struct io_uring_cqe *cqe;
+    struct io_uring_cqe *cqes[REAP_BATCH];
+    // Items of the pool this worker holds
+    long n_held = 0;
+
+    worker_id = id;
+    init_worker();
+    if(id == 0) {
+        process_dir(names.add(src_dir.c_str()), names.add(dst_dir.c_str()), 0);
+        n_held = 1;
+    }
 
     // Pipeline, pipeline, pipeline!
     while(true) {
-
-        // For debugging, uncomment me.
-        // if(count > 9) {
-        //     exit(1);
-        // }
-        // count += 1;
-
-
-        // TODO: P2: Find a better way to determine all jobs are complete.
-        // ret = io_uring_wait_cqe_nr(&ring, &cqe, in_progress_jobs-1);
-
-        // ret = io_uring_wait_cqe_timeout(&ring, &cqe, &ts);
-        ret = io_uring_peek_cqe(&ring, &cqe);
-        if(ret != 0) {
-            assert(cqe == NULL);
-            if(in_progress_jobs == 0)
-                exit(0);
-            continue;
-        }
-        if(ret != 0) {
-            cerr << "Failed to get cqe: " << strerror(-ret) << endl;
-            if(in_progress_jobs == 0) {
-                cout << "No pending jobs and failed to get cqe, exiting" << endl;
-                // sync();
-                exit(0);
+        unsigned n = io_uring_peek_batch_cqe(&ring, cqes, REAP_BATCH);
+        if(n == 0) {
+            if(credits.get_cqes_in_flight() == 0) {
+                // All it held is copied: take more, or wait for the others
+                pool->done(n_held);
+                n_held = 0;
+                SharedDir work;
+                if(pool->pop(worker_id, work)) {
+                    n_held = 1;
+                    adopt_dir(work);
+                    continue;
+                }
+                if(pool->finished())
+                    break;
+                pool->idle();
+                continue;
+            }
+            // Spin for a while, then sleep until a cqe is posted
+            ret = waiter.wait_cqe(&ring, &cqe);
+            if(ret != 0) {
+                cerr << "Failed to get cqe: " << strerror(-ret) << endl;
+                exit(1);
             }
-            exit(1);
+            continue;
         }
-        ret = process_cqe(cqe);
-        if(ret == 0) {
-            io_uring_cqe_seen(&ring, cqe);
-            in_progress_jobs -= 1;
-            // cout << "in_progress_jobs = " << in_progress_jobs << endl;
-        } else {
-            assert(0);
+        for(unsigned i = 0; i < n; i++) {
+            ret = process_cqe(cqes[i]);
+            assert(ret == 0);
         }
+        // One CQ head update for the whole batch
+        io_uring_cq_advance(&ring, n);
+        credits.put_cqes(n);
         process_copy_jobs();
         process_dir_jobs();
+        if(pool->has_idle())
+            share_work();
     }
+
+    if(wait_stats)
+        waiter.report(stderr);
+    io_uring_queue_exit(&ring);
+}
+
+int main(int argc, char** argv) {
+    cxxopts::Options options("fcp2", "fast cp, pipelined");
+    options.add_options()
+    ("a,kernel_alloc", "let the kernel pick fixed file slots", cxxopts::value<bool>()->default_value("false"))
+    ("w,spin_us", "µs to poll for completions before sleeping, -1 to never sleep", cxxopts::value<int>()->default_value(std::to_string(DEFAULT_SPIN_US)))
+    ("wait_stats", "report the time spent spinning and sleeping for completions", cxxopts::value<bool>()->default_value("false"))
+    ("phys_order", "start copying files in the order their data sits on disk", cxxopts::value<bool>()->default_value("false"))
+    ("j,threads", "number of workers, each with its own ring and fixed file slots", cxxopts::value<int>()->default_value("1"))
+    ("h,help", "Print usage");
+
+    auto result = options.parse(argc, argv);
+    if (result.count("help")) {
+        cout << options.help() << endl;
+        exit(0);
+    }
+    kernel_alloc = result["kernel_alloc"].as<bool>();
+    spin_us = result["spin_us"].as<int>();
+    wait_stats = result["wait_stats"].as<bool>();
+    phys_order = result["phys_order"].as<bool>();
+    int n_workers = max(1, result["threads"].as<int>());
+
+    const filesystem::path src_dir("/home/ubuntu/project/aos_project/src_dir");
+    const filesystem::path dst_dir("/home/ubuntu/project/aos_project/dst_dir");
+
+    // Worker 0 holds the copy of src_dir until it is shared out
+    work_pool<SharedDir> shared(n_workers, 1);
+    pool = &shared;
+    vector<thread> workers;
+    for(int i=1; i<n_workers; i++)
+        workers.emplace_back(run_worker, i, std::cref(src_dir), std::cref(dst_dir));
+    run_worker(0, src_dir, dst_dir);
+    for(auto& worker: workers)
+        worker.join();
+    exit(n_failed_jobs > 0 ? 1 : 0);
 }
@@ -0,0 +1,28 @@
+#include "fiemap.h"
+#include <stddef.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+uint64_t first_phys_offset(int fd)
+{
+    //! room for a single extent; FIEMAP fills in as many as fit
+    union
+    {
+        struct fiemap fm;
+        char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } u = {};
+    u.fm.fm_start = 0;
+    u.fm.fm_length = FIEMAP_MAX_OFFSET;
+    u.fm.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &u.fm) != 0 || u.fm.fm_mapped_extents == 0)
+    {
+        return 0;
+    }
+    //! not allocated yet (delalloc), or placed where it can't be told
+    if (u.fm.fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC))
+    {
+        return 0;
+    }
+    return u.fm.fm_extents[0].fe_physical;
+}
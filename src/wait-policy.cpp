@@ -0,0 +1,56 @@
+#include "wait-policy.h"
+#include <time.h>
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+WaitPolicy::WaitPolicy()
+{
+    init(0);
+}
+
+void WaitPolicy::init(unsigned spin_us)
+{
+    spin_us_ = spin_us;
+    spin_ns_ = sleep_ns_ = 0;
+    n_spun_ = n_slept_ = 0;
+}
+
+int WaitPolicy::wait_cqe(struct io_uring* ring, struct io_uring_cqe** cqe_ptr)
+{
+    //! Already there, nothing to account for
+    if (io_uring_peek_cqe(ring, cqe_ptr) == 0)
+    {
+        return 0;
+    }
+
+    const uint64_t start = now_ns();
+    const uint64_t spin_end = (spin_us_ == SPIN_FOREVER) ? UINT64_MAX : start + spin_us_ * 1000ULL;
+    uint64_t now = start;
+    while (now < spin_end)
+    {
+        if (io_uring_peek_cqe(ring, cqe_ptr) == 0)
+        {
+            spin_ns_ += now_ns() - start;
+            n_spun_++;
+            return 0;
+        }
+        now = now_ns();
+    }
+    spin_ns_ += now - start;
+
+    int ret = io_uring_wait_cqe(ring, cqe_ptr);
+    sleep_ns_ += now_ns() - now;
+    n_slept_++;
+    return ret;
+}
+
+void WaitPolicy::report(FILE* out) const
+{
+    fprintf(out, "waiting for cqes: spun %.3f ms (%lu waits done spinning), slept %.3f ms (%lu waits)\n",
+            spin_ns_ / 1e6, (unsigned long)n_spun_, sleep_ns_ / 1e6, (unsigned long)n_slept_);
+}
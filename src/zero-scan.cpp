@@ -0,0 +1,85 @@
+#include "zero-scan.h"
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+static bool is_zero_scalar(const char* buf, size_t len)
+{
+    for (; len >= 32; buf += 32, len -= 32)
+    {
+        uint64_t w[4];
+        memcpy(w, buf, sizeof(w));
+        if (w[0] | w[1] | w[2] | w[3]) return false;
+    }
+    for (; len; buf++, len--)
+    {
+        if (*buf) return false;
+    }
+    return true;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static bool is_zero_sse2(const char* buf, size_t len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    for (; len >= 64; buf += 64, len -= 64)
+    {
+        __m128i v = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i*)buf),
+                         _mm_loadu_si128((const __m128i*)(buf + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i*)(buf + 32)),
+                         _mm_loadu_si128((const __m128i*)(buf + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff) return false;
+    }
+    return is_zero_scalar(buf, len);
+}
+
+__attribute__((target("avx2")))
+static bool is_zero_avx2(const char* buf, size_t len)
+{
+    for (; len >= 128; buf += 128, len -= 128)
+    {
+        __m256i v = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i*)buf),
+                            _mm256_loadu_si256((const __m256i*)(buf + 32))),
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(buf + 64)),
+                            _mm256_loadu_si256((const __m256i*)(buf + 96))));
+        if (!_mm256_testz_si256(v, v)) return false;
+    }
+    return is_zero_sse2(buf, len);
+}
+#endif
+
+typedef bool (*is_zero_fn)(const char*, size_t);
+
+static is_zero_fn pick_is_zero()
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return is_zero_avx2;
+    if (__builtin_cpu_supports("sse2")) return is_zero_sse2;
+#endif
+    return is_zero_scalar;
+}
+
+bool is_zero(const char* buf, size_t len)
+{
+    static const is_zero_fn fn = pick_is_zero();
+    return fn(buf, len);
+}
+
+size_t block_run(const char* buf, size_t len, size_t blk, bool zero)
+{
+    size_t n = 0;
+    while (n < len)
+    {
+        const size_t b = (len - n < blk) ? len - n : blk;
+        if (is_zero(buf + n, b) != zero) break;
+        n += b;
+    }
+    return n;
+}
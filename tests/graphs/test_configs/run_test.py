@@ -336,6 +336,10 @@ def get_params_info():
             'default': 1,
             'fcp_flag': '-n'
         },
+        'chunk_bufs': {
+            'default': 1,
+            'fcp_flag': '-c'
+        },
         'buffer_size_kb': {
             'default': 128,
             'fcp_flag': '-b',